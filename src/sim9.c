@@ -25,10 +25,108 @@
 #include <string.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 
 #include "sim9.h"
 
+#ifndef SIM9_NO_TIMER
+/*! TIMER2 compare value for a 1 ms tick with a /64 prescaler. */
+#define SIM9_TIMER_TOP ((F_CPU / 64000UL) - 1)
+
+#if SIM9_TIMER_TOP > 255
+#error "F_CPU too high for the TIMER2 millisecond tick."
+#endif
+#endif
+
+#ifdef SIM9_NO_MALLOC
+/*! Fail the link if the heap is pulled in.
+ *
+ * These replace the avr-libc allocator with functions referencing an
+ * undefined symbol. Built with -ffunction-sections and linked with
+ * -Wl,--gc-sections they are discarded unless someone calls them.
+ */
+extern void sim9_heap_is_disabled(void);
+
+void *malloc(size_t size)
+{
+	sim9_heap_is_disabled();
+	return(NULL);
+}
+
+void free(void *ptr)
+{
+	sim9_heap_is_disabled();
+}
+
+/*! static storage of the sim9 struct and strings */
+static struct sim9_t sim9_struct;
+static char sim9_imei[IMEI_SIZE];
+static char sim9_gmr[GMR_SIZE];
+static char sim9_model[MODEL_SIZE];
+static char sim9_gps_lat[GPS_LAT_SIZE];
+static char sim9_gps_lon[GPS_LON_SIZE];
+#endif
+
+/*! the line parser */
+static struct sim9_line_t sim9_line;
+
+/*! the AT command engine */
+static struct sim9_at_t sim9_at;
+
+/*! command line built by sim9_send_batch_P() */
+static char sim9_batch[SIM9_BATCH_LINE];
+
+/*! the last modem profile saved */
+static struct sim9_profile_t EEMEM sim9_ee_profile;
+
+/*! the client connection */
+static struct sim9_conn_t sim9_conn;
+
+/*! the transparent mode stream */
+static struct sim9_stream_t sim9_stream;
+
+/*! the non-transparent mode send buffer */
+static struct sim9_cipsend_t sim9_cipsend;
+
+/*! the modem identity cache */
+static struct sim9_ident_t EEMEM sim9_ee_ident;
+
+#ifndef SIM9_NO_TIMER
+/*! milliseconds since sim9_init() */
+static volatile uint32_t sim9_ticks;
+
+/*! millisecond tick */
+ISR(TIMER2_COMPA_vect)
+{
+	sim9_ticks++;
+}
+
+/*! TIMER2 millisecond time base.
+ *
+ * \return the tick counter, wrap around after ~49 days.
+ */
+uint32_t sim9_timer_millis(void)
+{
+	uint32_t ms;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ms = sim9_ticks;
+	}
+
+	return(ms);
+}
+
+/*! the time base in use */
+static uint32_t (*sim9_clock)(void) = sim9_timer_millis;
+#else
+/*! the time base in use, must be set with sim9_set_clock() */
+static uint32_t (*sim9_clock)(void);
+#endif
+
 #ifdef SIM9_DEBUG_PORT
 /*! send a string to the debug port.
  *
@@ -73,6 +171,22 @@ void debug_usart_buffer(void)
 }
 #endif
 
+/*! send a char to the modem.
+ *
+ * With the flow control wait for the modem to be ready.
+ *
+ * \param c the char.
+ */
+static void sim9_putchar(const char c)
+{
+#ifdef SIM9_FLOW_CTRL
+	while (PINA & _BV(SIM9_CTS))
+		sim9_idle();
+#endif
+
+	usart_putchar(SIM9_SERIAL_PORT, c);
+}
+
 /*! send a string to the modem.
  *
  * Commands terminate with CR.
@@ -82,7 +196,16 @@ void debug_usart_buffer(void)
  */
 void sim9_send(const char *s)
 {
+#ifdef SIM9_FLOW_CTRL
+	const char *p;
+
+	p = s ? s : sim9->tx_buf;
+
+	while (*p)
+		sim9_putchar(*p++);
+#else
 	usart_printstr(SIM9_SERIAL_PORT, s);
+#endif
 
 #ifdef SIM9_DEBUG_PORT
 	sim9_debug_P(PSTR("-> "));
@@ -99,13 +222,26 @@ void sim9_send(const char *s)
 /*! send a flash string to the modem.
  *
  * Commands terminate with CR.
+ * The string is streamed byte by byte from the flash to the
+ * usart, nothing is copied to ram.
  *
  * \param *s the string to send (PSTR() to store it in flash space).
  */
 void sim9_send_P(PGM_P s)
 {
-	strncpy_P(sim9->tx_buf, s, sim9->usart->tx_size);
-	sim9_send(NULL);
+	PGM_P p;
+	char c;
+
+	p = s;
+
+	while ((c = pgm_read_byte(p++)))
+		sim9_putchar(c);
+
+#ifdef SIM9_DEBUG_PORT
+	sim9_debug_P(PSTR("-> "));
+	sim9_debug_P(s);
+	sim9_debug_P(PSTR("\n"));
+#endif
 }
 
 /*! \brief Clear RX buffer.
@@ -116,6 +252,83 @@ void sim9_send_P(PGM_P s)
 void sim9_clear_rx_buff(void)
 {
 	usart_clear_rx_buffer(SIM9_SERIAL_PORT);
+	sim9_line_clear();
+}
+
+/*! Start the millisecond time base.
+ *
+ * TIMER2 in CTC mode, F_CPU / 64 prescaler, IRQ on compare match.
+ * Nothing to do if the time base is not the TIMER2 one.
+ */
+void sim9_timer_init(void)
+{
+#ifndef SIM9_NO_TIMER
+	if (sim9_clock != sim9_timer_millis)
+		return;
+
+	TCCR2A = _BV(WGM21);
+	OCR2A = SIM9_TIMER_TOP;
+	TIMSK2 = _BV(OCIE2A);
+	TCCR2B = _BV(CS22);
+#endif
+}
+
+/*! Use an external millisecond time base.
+ *
+ * Call it before sim9_init() to keep TIMER2 free.
+ *
+ * \param millis the function returning the milliseconds elapsed,
+ *  it must wrap around at 0xffffffff.
+ */
+void sim9_set_clock(uint32_t (*millis)(void))
+{
+	sim9_clock = millis;
+}
+
+/*! Milliseconds elapsed from the time base.
+ *
+ * \return the time, wrap around after ~49 days.
+ */
+uint32_t sim9_millis(void)
+{
+	return(sim9_clock());
+}
+
+/*! Is the deadline expired?
+ *
+ * \param start the sim9_millis() value the timeout refers to.
+ * \param timeout in milliseconds.
+ * \return TRUE if expired, wrap around safe.
+ */
+uint8_t sim9_expired(const uint32_t start, const uint32_t timeout)
+{
+	return((sim9_millis() - start) >= timeout);
+}
+
+/*! Put the cpu in idle sleep until the next IRQ.
+ *
+ * The usart RX and the time base IRQs wake it up.
+ */
+void sim9_idle(void)
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_mode();
+}
+
+/*! Wait for a time, the cpu sleeps.
+ *
+ * Bytes received meanwhile are left in the usart buffer.
+ *
+ * \param ms the time in milliseconds.
+ */
+void sim9_delay_ms(const uint32_t ms)
+{
+	uint32_t start;
+
+	start = sim9_millis();
+
+	while (!sim9_expired(start, ms))
+		sim9_idle();
 }
 
 /*! Get char from the modem
@@ -129,369 +342,1848 @@ void sim9_clear_rx_buff(void)
  */
 uint8_t sim9_wait4char(const char s, uint8_t timeout)
 {
+	uint32_t start;
 	char c;
 
-	while (timeout--) {
-		if (usart_get(SIM9_SERIAL_PORT, (uint8_t *)&c, 1) && c == s)
-			return(TRUE);
+	start = sim9_millis();
 
-		_delay_ms(1000);
-	}
+	do {
+		while (usart_get(SIM9_SERIAL_PORT, (uint8_t *)&c, 1))
+			if (c == s)
+				return(TRUE);
+
+		sim9_idle();
+	} while (!sim9_expired(start, timeout * 1000UL));
 
 	return(FALSE);
 }
 
-/*! Check and get a message from the modem.
- *
- * Check the usart RX flag and, in case there is a message, get it.
- * You have a timeout in seconds to complete the operation.
- *
- * The message from the sim9xx is in the form of:
- * [CR][LF]<message>[CR][LF]
- *
- * which generates 2 message in the queue if [LF] is the End Of Message.
- *
- * \note the use of milliseconds instead of second is to increment
- * the number of checks the function will perform.
+/*! Final result codes, in the order of the SIM9_RC_* codes
+ * starting from SIM9_RC_OK.
+ */
+static const char rc_ok[] PROGMEM = "OK";
+static const char rc_error[] PROGMEM = "ERROR";
+static const char rc_cme_error[] PROGMEM = "+CME ERROR";
+static const char rc_cms_error[] PROGMEM = "+CMS ERROR";
+static const char rc_no_carrier[] PROGMEM = "NO CARRIER";
+static const char rc_busy[] PROGMEM = "BUSY";
+static const char rc_no_answer[] PROGMEM = "NO ANSWER";
+static const char rc_no_dialtone[] PROGMEM = "NO DIALTONE";
+static const char rc_send_fail[] PROGMEM = "SEND FAIL";
+static const char rc_closed[] PROGMEM = "CLOSED";
+static const char rc_connect_fail[] PROGMEM = "CONNECT FAIL";
+
+static PGM_P const rc_table[] PROGMEM = {
+	rc_ok,
+	rc_error,
+	rc_cme_error,
+	rc_cms_error,
+	rc_no_carrier,
+	rc_busy,
+	rc_no_answer,
+	rc_no_dialtone,
+	rc_send_fail,
+	rc_closed,
+	rc_connect_fail
+};
+
+#define RC_TABLE_SIZE (sizeof(rc_table) / sizeof(PGM_P))
+
+/*! Unsolicited result codes, in the order of the SIM9_URC_* codes.
+ */
+static const char urc_ring[] PROGMEM = "RING";
+static const char urc_cmti[] PROGMEM = "+CMTI:";
+static const char urc_pdp_deact[] PROGMEM = "+PDP: DEACT";
+static const char urc_closed[] PROGMEM = "CLOSED";
+static const char urc_under_voltage[] PROGMEM = "UNDER-VOLTAGE";
+static const char urc_over_voltage[] PROGMEM = "OVER-VOLTAGE";
+static const char urc_call_ready[] PROGMEM = "Call Ready";
+static const char urc_power_down[] PROGMEM = "NORMAL POWER DOWN";
+static const char urc_rdy[] PROGMEM = "RDY";
+static const char urc_creg[] PROGMEM = "+CREG:";
+static const char urc_cgreg[] PROGMEM = "+CGREG:";
+static const char urc_connect_ok[] PROGMEM = "CONNECT OK";
+static const char urc_already_connect[] PROGMEM = "ALREADY CONNECT";
+static const char urc_connect_fail[] PROGMEM = "CONNECT FAIL";
+static const char urc_state[] PROGMEM = "STATE:";
+static const char urc_connect[] PROGMEM = "CONNECT";
+
+static PGM_P const urc_table[] PROGMEM = {
+	urc_ring,
+	urc_cmti,
+	urc_pdp_deact,
+	urc_closed,
+	urc_under_voltage,
+	urc_over_voltage,
+	urc_call_ready,
+	urc_power_down,
+	urc_rdy,
+	urc_creg,
+	urc_cgreg,
+	urc_connect_ok,
+	urc_already_connect,
+	urc_connect_fail,
+	urc_state,
+	urc_connect
+};
+
+/*! AT+CIPSTATUS states, in the order of the SIM9_TCPIP_* codes.
+ * "TCP " and "UDP " are skipped.
+ */
+static const char tcpip_initial[] PROGMEM = "IP INITIAL";
+static const char tcpip_start[] PROGMEM = "IP START";
+static const char tcpip_config[] PROGMEM = "IP CONFIG";
+static const char tcpip_gprsact[] PROGMEM = "IP GPRSACT";
+static const char tcpip_status[] PROGMEM = "IP STATUS";
+static const char tcpip_connecting[] PROGMEM = "CONNECTING";
+static const char tcpip_connect_ok[] PROGMEM = "CONNECT OK";
+static const char tcpip_closing[] PROGMEM = "CLOSING";
+static const char tcpip_closed[] PROGMEM = "CLOSED";
+static const char tcpip_pdp_deact[] PROGMEM = "PDP DEACT";
+
+static PGM_P const tcpip_table[] PROGMEM = {
+	tcpip_initial,
+	tcpip_start,
+	tcpip_config,
+	tcpip_gprsact,
+	tcpip_status,
+	tcpip_connecting,
+	tcpip_connect_ok,
+	tcpip_closing,
+	tcpip_closed,
+	tcpip_pdp_deact
+};
+
+#define TCPIP_TABLE_SIZE (sizeof(tcpip_table) / sizeof(PGM_P))
+
+#define URC_TABLE_SIZE (sizeof(urc_table) / sizeof(PGM_P))
+
+/* one bit each in the sim9_match_t bitmaps */
+_Static_assert(RC_TABLE_SIZE <= 32, "rc_table too big");
+_Static_assert(URC_TABLE_SIZE <= 32, "urc_table too big");
+
+/*! Advance the strings of a table still matching the line.
  *
- * \warning if the pre-allocated space 's' < sizeof(rx-buffer), a
- * truncated non-terminated message can be returned.
- * \warning if sizeof(msg) < 2 the msg is ignored.
- * \warning loop <= 0xffff
- * \warning msg[size - 2] will be = 0 to terminate the string by
- * eliminating the [cr][lf].
+ * The strings are matched from the beginning of the line, a string
+ * is complete when its end is reached, the rest of the line is a
+ * parameter.
  *
- * \param s pre-allocated string space.
- * \param size size_of(s)
- * \param timeout timeout in seconds (max. 0xff).
- * \return the lenght of the message.
+ * \param table the PROGMEM table of PROGMEM strings.
+ * \param size the number of strings in the table.
+ * \param alive bitmap of the strings still matching.
+ * \param pos the position of c in the line.
+ * \param c the char, 0 at the end of the line.
+ * \return the index + 1 of the string completed or 0.
  */
-uint8_t sim9_msg(char *s, const uint8_t size, const uint8_t timeout)
+static uint8_t table_step(PGM_P const *table, const uint8_t size,
+		uint32_t *alive, const uint8_t pos, const char c)
 {
-	uint8_t len;
-	uint16_t loop;
+	uint32_t bit;
+	uint8_t i, found;
+	char t;
 
-	len = 0;
-
-	/* loop and the _delay_ms must be equal to 1 second
-	 * in order to keep the timeout valid.
-	 */
-	loop = timeout * 100;
+	found = 0;
 
-	do {
-		_delay_ms(10);
+	for (i = 0, bit = 1; *alive && i < size; i++, bit <<= 1) {
+		if (!(*alive & bit))
+			continue;
 
-		if (sim9->usart->flags.eol) {
-			len = usart_getmsg(SIM9_SERIAL_PORT,
-					(uint8_t *)s, size);
+		t = pgm_read_byte((PGM_P)pgm_read_word(&table[i]) + pos);
 
-			/* Ignore message compose only by CR LF */
-			if (len < 3)
-				len = 0;
+		if (!t) {
+			found = i + 1;
+			*alive &= ~bit;
+		} else if (t != c) {
+			*alive &= ~bit;
 		}
-	} while (!len && loop--);
-
-	/* if a valid message, terminate the string over the CR.
-	 * len is 0 or > 2
-	 */
-	if (len) {
-		s[len - 2] = 0;
-
-#ifdef SIM9_DEBUG_PORT
-		sim9_debug_P(PSTR("<- "));
-		sim9_debug(s);
-		sim9_debug_P(PSTR("\n"));
-#endif
 	}
 
-	return (len);
+	return(found);
 }
 
-/*! Search for string from the modem.
- *
- * For example used after sending an AT command to
- * the modem and wait for the OK string.
- *
- * \note A positive match will be returned also if the string is a
- * substring of what returned from the modem.
- *
- * \note If count == 0; then count = 1 by default.
- *
- * \note count require 1sec max timeout, ex. count = 5 and no message
- * incoming, it will wait 5 sec. before error.
- *
- * \note If the message is not complete then it will be 2 chars shorter
- * than expected, because it was suppose to be terminated by CRLF.
- *
- * \param s the string to look for.
- *
- * \param count max number of VALID msgs (\see sim9_msg())
- *  to analyze before error.
- *
- * \param extbuff is the space reserved for the complete matching
- *  string found. If NULL is passed, then a buffer of
- *  size = sim9->usart->rx->size will be allocated.
+/*! get the i-th char of the caller pattern */
+static char match_pattern_char(struct sim9_match_t *m, const uint8_t i)
+{
+	if (m->progmem)
+		return(pgm_read_byte(m->s + i));
+	else
+		return(m->s[i]);
+}
+
+/*! Initialize a line matcher.
  *
- * \param size the size of extbuff.
+ * Every final result code and URC is matched from the beginning of
+ * the line, the caller pattern according to the search type.
  *
- * \param type the type of search can be:
- *  EQUAL the string must be equal to the message.
- *  EEQUAL as EQUAL or ERROR.
- *  RELAX the string can be any substring of the message.
- *  ERELAX as RELAX or ERROR.
- *  STRICT the string is a substring that match from the beginning
- *   of the message.
- *  ESTRICT as STRICT or ERROR.
+ * \param m the matcher.
+ * \param s the caller pattern, can be NULL.
+ * \param progmem TRUE if s is a PROGMEM string.
+ * \param type EQUAL, RELAX ... \see searchfor().
+ * \note RELAX patterns are limited to the first 32 chars.
+ */
+void sim9_match_init(struct sim9_match_t *m, const char *s,
+		const uint8_t progmem, const uint8_t type)
+{
+	m->s = s;
+	m->sa = 0;
+	m->codes = (uint32_t)((1ULL << RC_TABLE_SIZE) - 1);
+	m->urcs = (uint32_t)((1ULL << URC_TABLE_SIZE) - 1);
+	m->pos = 0;
+	m->slen = 0;
+	m->rc = SIM9_RC_NONE;
+	m->urc = SIM9_URC_NONE;
+	m->progmem = progmem;
+	m->relax = (type == RELAX || type == ERELAX);
+	m->found = FALSE;
+
+	if (s)
+		m->slen = progmem ? strlen_P(s) : strlen(s);
+
+	if (m->relax && m->slen > 32)
+		m->slen = 32;
+
+	/* an empty pattern match everything */
+	if (s && !m->slen)
+		m->found = TRUE;
+
+	m->prefix = (m->slen && !m->relax);
+}
+
+/*! Feed the next char of the line to the matcher.
  *
- * \return TRUE string found, FALSE not found.
+ * All the final result codes and URCs still alive and the caller
+ * pattern advance together on every char, the line is never
+ * rescanned. The caller pattern in RELAX mode is a Shift-And
+ * automaton.
  *
- * \warning count <= 0xff
- * \warning size <= 0xff
- * \bug the string s should be checked not to be larger than the
- * allocated RX buffer size or this function will always fail.
+ * \param m the matcher.
+ * \param c the char.
  */
-uint8_t sim9_searchfor(const char *s, uint8_t count,
-		char *extbuff, const uint8_t extsize, const uint8_t type)
+void sim9_match_step(struct sim9_match_t *m, const char c)
 {
-	uint8_t ok, check_error, size;
-	char *buffer;
-
-	ok = FALSE;
+	uint32_t mask;
+	uint8_t i;
+	char t;
 
-	/* in case of "ERROR" string */
-	check_error = FALSE;
+	i = table_step(rc_table, RC_TABLE_SIZE, &m->codes, m->pos, c);
 
-	/* check for the external of allocated buffer */
-	if (extbuff) {
-		size = extsize;
-		buffer = extbuff;
-	} else {
-		size = sim9->usart->rx->size;
-		buffer = malloc(size);
-	}
+	if (i)
+		m->rc = i - 1 + SIM9_RC_OK;
 
-#ifdef SIM9_DEBUG_PORT
-	sim9_debug_P(PSTR("?: "));
-	sim9_debug(s);
-	sim9_debug_P(PSTR(" ["));
-	buffer = itoa(count, buffer, 10);
-	sim9_debug(buffer);
-	sim9_debug_P(PSTR("/"));
-	buffer = itoa(sim9->usart->flags.eol, buffer, 10);
-	sim9_debug(buffer);
-	sim9_debug_P(PSTR("]\n"));
-#endif
+	i = table_step(urc_table, URC_TABLE_SIZE, &m->urcs, m->pos, c);
 
-	/* Clear the buffer */
-	*(buffer) = 0;
+	if (i)
+		m->urc = i - 1;
 
-	do {
-		/* this will take 1 second top if no msg is present */
-		if (sim9_msg(buffer, size, 1)) {
-			switch(type) {
-				case ERELAX:
-					check_error = TRUE;
-				case RELAX:
-					if (strstr(buffer, s) != NULL)
-						ok = TRUE;
-					break;
-				case EEQUAL:
-					check_error = TRUE;
-				case EQUAL:
-				default:
-					if (strncmp(s, buffer, strlen(s)) == 0)
-						ok = TRUE;
-					break;
-			}
+	if (m->prefix) {
+		t = match_pattern_char(m, m->pos);
 
-			/* if I found ERROR as a message and
-			 * it is not what I was looking for
-			 * then exit.
-			 */
-			if (!ok && check_error &&
-					!strcmp_P(buffer, PSTR("ERROR")))
-				count = 0;
+		if (!t) {
+			m->found = TRUE;
+			m->prefix = FALSE;
+		} else if (t != c) {
+			m->prefix = FALSE;
 		}
-	} while (!ok && count--);
+	} else if (m->relax && !m->found) {
+		mask = 0;
 
-#ifdef SIM9_DEBUG_PORT
-	/* string is terminated by CRLF, but
-	 * the serial port strip the LF, not the CR.
-	 */
-	if (ok) {
-		sim9_debug_P(PSTR(" -[*]-\n"));
-	} else {
-		sim9_debug_P(PSTR(" -[NOTFOUND!]-\n"));
-		debug_usart_buffer();
-	}
-#endif
+		for (i = 0; i < m->slen; i++)
+			if (match_pattern_char(m, i) == c)
+				mask |= (1UL << i);
 
-	/* free the local buffer used. */
-	if (!extbuff)
-		free(buffer);
+		m->sa = ((m->sa << 1) | 1) & mask;
 
-	return(ok);
+		if (m->sa & (1UL << (m->slen - 1)))
+			m->found = TRUE;
+	}
+
+	if (m->pos < 0xff)
+		m->pos++;
 }
 
-/*! like the searchfor(), but it does not need to get the
- * matching string back and the search is a PROGMEM
- * string.
- *
- * \see sim9_searchfor()
+/*! End of line, get the result of the matcher.
  *
- * \warning This function allocate the current length of the
- *  string_P passed + the allocation of the searchfor()
- *  function.
+ * \param m the matcher, m->urc is the URC found.
+ * \return SIM9_RC_MATCH if the caller pattern is found, or
+ *  the final result code found or SIM9_RC_NONE.
  */
-uint8_t sim9_searchfor_P(PGM_P s, uint8_t count,
-		char *extbuff, const uint8_t extsize, const uint8_t type)
+uint8_t sim9_match_end(struct sim9_match_t *m)
 {
-	char *buffer;
-	uint8_t ok, size;
+	uint8_t i;
 
-	/* allocate the minor of + \0 char */
-	size = strnlen_P(s, sim9->usart->rx->size) + 1;
-	buffer = malloc(size);
-	/* copy the PROGMEM to ram */
-	strncpy_P(buffer, s, size);
-	/* termiante the string */
-	buffer[size - 1] = 0;
-	/* call the searchfor() */
-	ok = sim9_searchfor(buffer, count, extbuff, extsize, type);
-	/* deallocate the buffer */
-	free(buffer);
-	return (ok);
-}
+	/* codes and pattern matching the whole line */
+	i = table_step(rc_table, RC_TABLE_SIZE, &m->codes, m->pos, 0);
 
-/* Send an AT command to the device
- *
- * This is needed to handle the different situation
- * where the echo is enabled or not. If echo is enabled,
- * then sending <command + [CR]> will echo back the same,
- * but [CR] is not considered EOL ([LF] is) therefore there
- * will be no message present in the buffer, until an answer
- * is triggered.
- *
- * Answers (type param) can be:
- *
- * SENDAT_TYPE_NONE:
- *    No Answer.
- *
- * SENDAT_TYPE_OK:
- *    [CR][LF]OK[CR][LF]
- *    2 messages in the buffer, check for OK is performed..
- *
- * SENDAT_TYPE_MSGOK:
- *    [CR][LF]<something>[CR][LF]
- *    [CR][LF]OK[CR][LF]
- *    4 messages in the buffer.
- *
- * SENDAT_TYPE_MSG:
- *    [CR][LF]<something>[CR][LF]
- *    2 messages in the buffer, the <something> must be
- *    searched after this func().
- *
- * UNIMPLEMENTED:
- *    [CR][LF]OK[CR][LF]
- *    [CR][LF]<something>[CR][LF]
- *    4 messages in the buffer.
- *
- * \note if cmd == NULL, then send AT alone.
- *
- * \param cmd the command with AT.
- * \param msg the <something> needed back.
- * \param type the type of answer, see above.
- */
-uint8_t sim9_send_at(const char* cmd, char* msg,
-		const uint8_t size, const uint8_t type)
-{
-	uint8_t ok = TRUE;
+	if (i)
+		m->rc = i - 1 + SIM9_RC_OK;
 
-	sim9_send(cmd);
-	sim9_send_P(PSTR("\r"));
+	i = table_step(urc_table, URC_TABLE_SIZE, &m->urcs, m->pos, 0);
 
-	/* add the [LF] to trigger the EOM in the buffer
-	 * in case of echo.
-	 *
-	 * FIXME: In theory it is possible to start receiving
-	 * the answer to the command before the next \n is sent.
-	 * Echo should not be used at all.
-	 */
-	if (sim9->status.echo) {
-		sim9_send_P(PSTR("\n"));
-		/* wait for the echo back */
-		_delay_ms(100);
-		/* get the echo back from the buffer. */
-		ok = sim9_searchfor(cmd, sim9->usart->flags.eol + 1,
-				NULL, 0, EEQUAL);
-	}
+	if (i)
+		m->urc = i - 1;
 
-	/* wait for processing serial data */
-	_delay_ms(100);
+	m->codes = 0;
+	m->urcs = 0;
 
-	switch (type) {
-		case SENDAT_TYPE_MSGOK:
-			ok = ok && sim9_msg(msg, size,
-					sim9->usart->flags.eol + 1);
-		case SENDAT_TYPE_OK:
-			/* search OK */
-			ok = ok && sim9_searchfor_P(PSTR("OK"),
-					sim9->usart->flags.eol + 1,
-					NULL, 0, EEQUAL);
-			break;
-		case SENDAT_TYPE_MSG:
-			ok = ok && sim9_msg(msg, size,
-					sim9->usart->flags.eol + 1);
-			break;
-		default:
-			break;
-	}
+	if (m->prefix && !match_pattern_char(m, m->pos))
+		m->found = TRUE;
 
-	return (ok);
+	m->prefix = FALSE;
+
+	if (m->found)
+		return(SIM9_RC_MATCH);
+	else
+		return(m->rc);
 }
 
-/*! PROGMEM version of the send_at()
- *
- * Copy the command from the eeprom to ram and call
- * the sim9_send_at().
+/*! Classify a line in a single pass.
  *
- * \see sim9_send_at
- * \warning allocate strlen(cmd)
+ * \param line the message from the modem.
+ * \param s the caller pattern, can be NULL.
+ * \param progmem TRUE if s is a PROGMEM string.
+ * \param type the type of search \see searchfor().
+ * \return the SIM9_RC_* code.
  */
-uint8_t sim9_send_at_P(PGM_P cmd, char* msg,
-		const uint8_t msgsize, const uint8_t type)
+uint8_t sim9_classify(const char *line, const char *s,
+		const uint8_t progmem, const uint8_t type)
 {
-	char *buffer;
-	uint8_t ok, size;
+	struct sim9_match_t m;
+
+	sim9_match_init(&m, s, progmem, type);
+
+	while (*line)
+		sim9_match_step(&m, *(line++));
 
-	/* allocate the minor of cmd and rx->size + \0 */
-	size = strnlen_P(cmd, sim9->usart->rx->size) + 1;
-	buffer = malloc(size);
-	/* copy the PROGMEM to ram */
-	strncpy_P(buffer, cmd, size);
-	/* termiante the string */
-	buffer[size - 1] = 0;
-	/* call the non _P() */
-	ok = sim9_send_at(buffer, msg, msgsize, type);
-	/* deallocate the buffer */
-	free(buffer);
-	return (ok);
+	return(sim9_match_end(&m));
 }
 
-/*! send the escape sequence to the modem.
+/*! Is the code a final result code reporting a failure?
  *
- * there should be 1000ms idle period before this sequence, 500ms idle
- * period after this sequence and no more then 500ms between each +.
+ * \param rc the SIM9_RC_* code.
+ * \return TRUE if it is a failure.
  */
-void sim9_escape(void)
+uint8_t sim9_rc_failed(const uint8_t rc)
 {
-	uint8_t retry=3;
+	return(rc > SIM9_RC_OK);
+}
+
+/*! get the i-th char of the command in flight */
+static char line_cmd_char(const uint8_t i)
+{
+	if (sim9_line.cmd_progmem)
+		return(pgm_read_byte(sim9_line.cmd + i));
+	else
+		return(sim9_line.cmd[i]);
+}
+
+/*! The first char of a new line is received.
+ *
+ * Start the classification with the current expected string.
+ */
+static void line_start(void)
+{
+	sim9_match_init(&sim9_line.match, sim9_line.expect,
+			sim9_line.expect_progmem, sim9_line.expect_type);
+	sim9_line.echo = (sim9_line.cmd != NULL);
+}
+
+/*! Is the <stat> registered?
+ *
+ * \param stat the registration status.
+ * \return TRUE if home or roaming.
+ */
+static uint8_t reg_ok(const uint8_t stat)
+{
+	return(stat == SIM9_REG_HOME || stat == SIM9_REG_ROAMING);
+}
+
+/*! Update the registration from a +CREG or +CGREG line.
+ *
+ * The URC is "+CGREG: <stat>[,"<lac>","<ci>"]", the answer to the
+ * query has the <n> first, "+CGREG: <n>,<stat>[,"<lac>","<ci>"]".
+ * The registration latency is taken at the GPRS registration.
+ *
+ * \param urc SIM9_URC_CREG or SIM9_URC_CGREG.
+ */
+static void reg_update(const uint8_t urc)
+{
+	uint16_t f[4];
+	uint8_t i, n, quoted, stat;
+	char c;
+
+	/* the answer to AT+CGREG=?, the ranges */
+	if (memchr(sim9_line.buf, '(', sim9_line.len))
+		return;
+
+	n = 0;
+	quoted = 0;
+	f[0] = 0;
+	i = (urc == SIM9_URC_CREG) ? 6 : 7;
+
+	for (; i < sim9_line.len && n < 4; i++) {
+		c = sim9_line.buf[i];
+
+		if (c == ',') {
+			/* the <AcT> and what follows are not used */
+			if (n == 3)
+				break;
+
+			f[++n] = 0;
+		} else if (c == '"') {
+			quoted |= _BV(n);
+		} else if (c >= '0' && c <= '9') {
+			f[n] = (quoted & _BV(n)) ? (f[n] << 4) : (f[n] * 10);
+			f[n] += c - '0';
+		} else if (c >= 'A' && c <= 'F') {
+			f[n] = (f[n] << 4) + c - 'A' + 10;
+		}
+	}
+
+	/* the answer to the query, skip the <n> */
+	i = (n && !(quoted & _BV(1))) ? 1 : 0;
+	stat = f[i];
+
+	if (quoted & _BV(i + 1)) {
+		sim9->reg.lac = f[i + 1];
+		sim9->reg.ci = f[i + 2];
+	}
+
+	if (urc == SIM9_URC_CREG) {
+		sim9->reg.creg = stat;
+		return;
+	}
+
+	if (reg_ok(stat)) {
+		if (!reg_ok(sim9->reg.cgreg))
+			sim9->reg.latency = sim9_millis() - sim9->reg.start;
+
+		sim9->status.roaming = (stat == SIM9_REG_ROAMING);
+		sim9->errors.netreg = FALSE;
+	} else if (reg_ok(sim9->reg.cgreg)) {
+		/* lost, a new registration starts */
+		sim9->reg.start = sim9_millis();
+	}
+
+	sim9->reg.cgreg = stat;
+}
+
+/*! Update the connection state from a "STATE:" line.
+ */
+static void tcpip_update(void)
+{
+	const char *p;
+	uint8_t i;
+
+	p = sim9_line.buf + 7;
+
+	if (!strncmp_P(p, PSTR("TCP "), 4) || !strncmp_P(p, PSTR("UDP "), 4))
+		p += 4;
+
+	for (i = 0; i < TCPIP_TABLE_SIZE; i++)
+		if (!strcmp_P(p, (PGM_P)pgm_read_word(&tcpip_table[i]))) {
+			sim9->status.tcpip = i;
+			break;
+		}
+}
+
+/*! Dispatch an unsolicited result code.
+ *
+ * Update the status, set the event bit and call the handler,
+ * whatever command is in flight.
+ *
+ * \param urc the SIM9_URC_* code.
+ */
+static void urc_dispatch(const uint8_t urc)
+{
+	struct sim9_view_t v;
+
+	switch (urc) {
+		case SIM9_URC_CREG:
+		case SIM9_URC_CGREG:
+			reg_update(urc);
+			break;
+		case SIM9_URC_PDP_DEACT:
+			sim9->status.gprs = FALSE;
+			sim9->status.tcpip = SIM9_TCPIP_PDP_DEACT;
+			break;
+		case SIM9_URC_CONNECT:
+			/* data mode, the parser stops */
+			sim9->status.connected = TRUE;
+			sim9_stream.closed = 0;
+			sim9_stream.lf = TRUE;
+		case SIM9_URC_CONNECT_OK:
+		case SIM9_URC_ALREADY_CONNECT:
+			sim9->status.tcpip = SIM9_TCPIP_CONNECT_OK;
+			break;
+		case SIM9_URC_CLOSED:
+		case SIM9_URC_CONNECT_FAIL:
+			sim9->status.tcpip = SIM9_TCPIP_CLOSED;
+			break;
+		case SIM9_URC_STATE:
+			tcpip_update();
+			break;
+		case SIM9_URC_POWER_DOWN:
+			sim9->status.ready = FALSE;
+			break;
+		default:
+			break;
+	}
+
+	/* shared with the RI IRQ */
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sim9->events |= (1UL << urc);
+	}
+
+	if (sim9->urc_handler) {
+		v.s = sim9_line.buf;
+		v.len = sim9_line.len;
+		sim9->urc_handler(urc, &v);
+	}
+}
+
+/*! Is the URC the answer to the command in flight?
+ *
+ * The URC name up to the ':' follows the AT of the command,
+ * ex. "+CGREG:" for "AT+CGREG?".
+ *
+ * \param urc the SIM9_URC_* code.
+ * \return TRUE if the line goes to the command too.
+ */
+static uint8_t urc_answer(const uint8_t urc)
+{
+	PGM_P u;
+	uint8_t i;
+	char c;
+
+	if (!sim9_line.cmd)
+		return(FALSE);
+
+	u = (PGM_P)pgm_read_word(&urc_table[urc]);
+
+	for (i = 0; (c = pgm_read_byte(u + i)) != ':'; i++)
+		if (!c || (line_cmd_char(i + 2) != c))
+			return(FALSE);
+
+	return(i != 0);
+}
+
+/*! The End Of Line is received.
+ *
+ * The line is already classified, URCs are dispatched. An echo of
+ * the command in flight and an URC which is not a final result
+ * code are dropped unless they are the searched string or the
+ * answer to the command.
+ */
+static void line_end(void)
+{
+	uint8_t drop;
+
+	sim9_line.rc = sim9_match_end(&sim9_line.match);
+	sim9_line.urc = sim9_line.match.urc;
+	sim9_line.echo = sim9_line.echo && !line_cmd_char(sim9_line.pos);
+
+	if (sim9_line.echo)
+		sim9_line.echoed = TRUE;
+
+	if (sim9_line.urc != SIM9_URC_NONE)
+		urc_dispatch(sim9_line.urc);
+
+	/* "+CREG:" is also the answer to AT+CREG? */
+	drop = sim9_line.echo || (sim9_line.urc != SIM9_URC_NONE &&
+			sim9_line.rc == SIM9_RC_NONE &&
+			!urc_answer(sim9_line.urc));
+
+	if (drop && sim9_line.rc != SIM9_RC_MATCH)
+		sim9_line_next();
+	else
+		sim9_line.ready = TRUE;
+}
+
+/*! Feed a byte from the modem to the line parser.
+ *
+ * [CR] or [LF] terminate a line, empty lines are ignored, a '>'
+ * at the beginning of a line is the data prompt. The line is
+ * matched against the expected string, the final result codes
+ * and the echo of the command in flight byte by byte.
+ *
+ * It runs in the main context, sim9_rx_poll() feeds it from the
+ * usart buffer.
+ *
+ * \param c the byte received.
+ * \note the byte is discarded if a line is ready and not yet
+ * released with sim9_line_next().
+ */
+void sim9_rx_byte(const char c)
+{
+	if (sim9_line.ready)
+		return;
+
+	/* the space after the prompt */
+	if (sim9_line.skip) {
+		sim9_line.skip = FALSE;
+
+		if (c == ' ')
+			return;
+	}
+
+	switch (c) {
+		case '\r':
+		case '\n':
+			if (sim9_line.pos)
+				line_end();
+
+			break;
+		case '>':
+			if (!sim9_line.pos) {
+				sim9_line.prompt = TRUE;
+				sim9_line.skip = TRUE;
+				break;
+			}
+		default:
+			if (!sim9_line.pos)
+				line_start();
+
+			sim9_match_step(&sim9_line.match, c);
+
+			if (sim9_line.echo && (line_cmd_char(sim9_line.pos) != c))
+				sim9_line.echo = FALSE;
+
+			if (sim9_line.len < (SIM9_LINE_SIZE - 1)) {
+				sim9_line.buf[sim9_line.len++] = c;
+				sim9_line.buf[sim9_line.len] = 0;
+			}
+
+			if (sim9_line.pos < 0xff)
+				sim9_line.pos++;
+	}
+}
+
+/*! Drain the usart RX buffer into the line parser.
+ *
+ * Bytes are taken one at a time and the drain stops at the first
+ * complete line, the rest is left in the usart buffer.
+ *
+ * \return TRUE if a complete line is ready.
+ */
+uint8_t sim9_rx_poll(void)
+{
+	uint8_t c;
+
+	/* in data mode the bytes are for sim9_stream_read() */
+	while (!sim9_line.ready && !sim9->status.connected) {
+		if (!usart_get(SIM9_SERIAL_PORT, &c, 1)) {
+			/* the usart buffer is empty */
+			sim9_rx_level(0);
+			break;
+		}
+
+		sim9_rx_byte(c);
+	}
+
+	return(sim9_line.ready);
+}
+
+/*! RX flow control.
+ *
+ * Call it from the usart RX ISR with the RX buffer fill level,
+ * the RTS is raised at the high watermark and lowered at the low
+ * one. Does nothing without SIM9_FLOW_CTRL.
+ *
+ * \param level bytes in the RX buffer.
+ */
+void sim9_rx_level(const uint8_t level)
+{
+#ifdef SIM9_FLOW_CTRL
+	if (level >= SIM9_RTS_HIGH)
+		PORTA |= _BV(SIM9_RTS);
+	else if (level <= SIM9_RTS_LOW)
+		PORTA &= ~_BV(SIM9_RTS);
+#endif
+}
+
+/*! Release the current line and start a new one.
+ */
+void sim9_line_next(void)
+{
+	sim9_line.len = 0;
+	sim9_line.pos = 0;
+	sim9_line.buf[0] = 0;
+	sim9_line.echo = FALSE;
+	sim9_line.ready = FALSE;
+}
+
+/*! Get a view of the next line, the line is not copied.
+ *
+ * The line stays in the parser buffer and nothing more is drained
+ * from the usart until it is released with sim9_line_release().
+ *
+ * \param v the view to fill.
+ * \param timeout in milliseconds.
+ * \return TRUE if a line is available.
+ */
+uint8_t sim9_line_view(struct sim9_view_t *v, const uint32_t timeout)
+{
+	if (!sim9_wait_eol(sim9_millis(), timeout))
+		return(FALSE);
+
+	sim9_line.held = TRUE;
+	v->s = sim9_line.buf;
+	v->len = sim9_line.len;
+	return(TRUE);
+}
+
+/*! Release the line of a view.
+ *
+ * \warning the view is no more valid after this call.
+ */
+void sim9_line_release(void)
+{
+	sim9_line.held = FALSE;
+	sim9_line_next();
+}
+
+/*! Does the view start with a flash string?
+ *
+ * \param v the view.
+ * \param s the PROGMEM string.
+ * \return TRUE if the line starts with s.
+ */
+uint8_t sim9_view_P(const struct sim9_view_t *v, PGM_P s)
+{
+	uint8_t len;
+
+	len = strlen_P(s);
+	return((v->len >= len) && !strncmp_P(v->s, s, len));
+}
+
+/*! Set the string the incoming lines are matched against.
+ *
+ * A line already in progress is matched again with the new string.
+ *
+ * \param s the string, NULL for none.
+ * \param progmem TRUE if s is a PROGMEM string.
+ * \param type the type of search \see searchfor().
+ */
+void sim9_line_expect(const char *s, const uint8_t progmem,
+		const uint8_t type)
+{
+	uint8_t i;
+
+	sim9_line.expect = s;
+	sim9_line.expect_progmem = progmem;
+	sim9_line.expect_type = type;
+
+	if (sim9_line.ready) {
+		sim9_line.rc = sim9_classify(sim9_line.buf, s, progmem, type);
+	} else if (sim9_line.pos) {
+		sim9_match_init(&sim9_line.match, s, progmem, type);
+
+		for (i = 0; i < sim9_line.len; i++)
+			sim9_match_step(&sim9_line.match, sim9_line.buf[i]);
+	}
+}
+
+/*! Set the command in flight, its echo is suppressed.
+ *
+ * \param cmd the command, NULL for none.
+ * \param progmem TRUE if cmd is a PROGMEM string.
+ */
+void sim9_line_cmd(const char *cmd, const uint8_t progmem)
+{
+	sim9_line.cmd = cmd;
+	sim9_line.cmd_progmem = progmem;
+	sim9_line.echoed = FALSE;
+}
+
+/*! Clear the line parser.
+ */
+void sim9_line_clear(void)
+{
+	sim9_line_next();
+	sim9_line.prompt = FALSE;
+	sim9_line.skip = FALSE;
+}
+
+/*! Wait for an End Of Line from the modem.
+ *
+ * The bytes received are fed to the line parser, the cpu is put in
+ * idle sleep between checks, both the USART RX IRQ and the
+ * millisecond tick wake it up, so a complete line is detected as
+ * soon as it is received.
+ *
+ * \param start the sim9_millis() value the timeout refers to.
+ * \param timeout in milliseconds.
+ * \return TRUE if a complete line is ready.
+ */
+uint8_t sim9_wait_eol(const uint32_t start, const uint32_t timeout)
+{
+	while (!sim9_rx_poll()) {
+		if (sim9_expired(start, timeout))
+			return(FALSE);
+
+		sim9_idle();
+	}
+
+	return(TRUE);
+}
+
+/*! Check an event, do not clear it. */
+static uint8_t event_pending(const uint8_t urc)
+{
+	uint8_t ev;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ev = (sim9->events & (1UL << urc)) ? TRUE : FALSE;
+	}
+
+	return(ev);
+}
+
+/*! Check and clear an event.
+ *
+ * \param urc the SIM9_URC_* code.
+ * \return TRUE if the URC has been received since the last check.
+ */
+uint8_t sim9_event(const uint8_t urc)
+{
+	uint8_t ev;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ev = (sim9->events & (1UL << urc)) ? TRUE : FALSE;
+		sim9->events &= ~(1UL << urc);
+	}
+
+	return(ev);
+}
+
+/*! Wait for an URC.
+ *
+ * Lines received in the meantime are discarded.
+ *
+ * \param urc the SIM9_URC_* code.
+ * \param timeout in milliseconds.
+ * \return TRUE if the URC is received.
+ */
+uint8_t sim9_wait_event(const uint8_t urc, const uint32_t timeout)
+{
+	uint32_t start;
+
+	start = sim9_millis();
+
+	while (!event_pending(urc) && sim9_wait_eol(start, timeout))
+		sim9_line_next();
+
+	return(sim9_event(urc));
+}
+
+/*! Check and get a message from the modem.
+ *
+ * Wait for a complete line from the parser and copy it.
+ * You have a timeout in seconds to complete the operation.
+ *
+ * The message from the sim9xx is in the form of:
+ * [CR][LF]<message>[CR][LF]
+ *
+ * the framing is stripped and empty lines are ignored by the parser.
+ *
+ * \note the message is returned as soon as the line is complete,
+ * the cpu sleeps while waiting.
+ *
+ * \warning if the pre-allocated space 's' < SIM9_LINE_SIZE, a
+ * truncated message can be returned.
+ *
+ * \param s pre-allocated string space.
+ * \param size size_of(s)
+ * \param timeout timeout in seconds (max. 0xff).
+ * \return the lenght of the message.
+ */
+uint8_t sim9_msg(char *s, const uint8_t size, const uint8_t timeout)
+{
+	uint8_t len;
+
+	len = 0;
+
+	if (sim9_wait_eol(sim9_millis(), timeout * 1000UL)) {
+		len = sim9_line.len;
+		strncpy(s, sim9_line.buf, size);
+		s[size - 1] = 0;
+		sim9_line_next();
+
+#ifdef SIM9_DEBUG_PORT
+		sim9_debug_P(PSTR("<- "));
+		sim9_debug(s);
+		sim9_debug_P(PSTR("\n"));
+#endif
+	}
+
+	return (len);
+}
+
+/*! Search for string from the modem.
+ *
+ * For example used after sending an AT command to
+ * the modem and wait for the OK string.
+ *
+ * \note A positive match will be returned also if the string is a
+ * substring of what returned from the modem.
+ *
+ * \note If count == 0; then count = 1 by default.
+ *
+ * \note count require 1sec max timeout, ex. count = 5 and no message
+ * incoming, it will wait 5 sec. before error.
+ *
+ * \note Every message is classified by the line parser while it is
+ * received, against the string and all the final result codes, the
+ * last code found is stored in sim9->rc.
+ *
+ * \param s the string to look for.
+ *
+ * \param progmem TRUE if s is a PROGMEM string.
+ *
+ * \param count max number of VALID msgs (\see sim9_msg())
+ *  to analyze before error.
+ *
+ * \param extbuff is the space reserved for the complete matching
+ *  string found, can be NULL.
+ *
+ * \param size the size of extbuff.
+ *
+ * \param type the type of search can be:
+ *  EQUAL the string must be equal to the message.
+ *  EEQUAL as EQUAL or a failure final result code.
+ *  RELAX the string can be any substring of the message.
+ *  ERELAX as RELAX or a failure final result code.
+ *  STRICT the string is a substring that match from the beginning
+ *   of the message.
+ *  ESTRICT as STRICT or a failure final result code.
+ *
+ *  With the E types the search stops as soon as a failure code
+ *  (ERROR, +CME ERROR, NO CARRIER, SEND FAIL, CLOSED ...) is received.
+ *
+ * \return TRUE string found, FALSE not found.
+ *
+ * \warning count <= 0xff
+ * \warning size <= 0xff
+ * \bug the string s should be checked not to be larger than
+ * SIM9_LINE_SIZE or this function will always fail.
+ */
+static uint8_t searchfor(const char *s, const uint8_t progmem,
+		uint8_t count, char *extbuff, const uint8_t extsize,
+		const uint8_t type)
+{
+	uint8_t ok, check_error, rc;
+#ifdef SIM9_DEBUG_PORT
+	char num[4];
+#endif
+
+	ok = FALSE;
+
+	/* in case of failure codes */
+	check_error = (type == EEQUAL || type == ERELAX || type == ESTRICT);
+
+#ifdef SIM9_DEBUG_PORT
+	sim9_debug_P(PSTR("?: "));
+
+	if (progmem)
+		sim9_debug_P(s);
+	else
+		sim9_debug(s);
+
+	sim9_debug_P(PSTR(" ["));
+	sim9_debug(utoa(count, num, 10));
+	sim9_debug_P(PSTR("]\n"));
+#endif
+
+	/* Clear the buffer */
+	if (extbuff)
+		*(extbuff) = 0;
+
+	sim9_line_expect(s, progmem, type);
+
+	do {
+		/* this will take 1 second top if no msg is present */
+		if (sim9_wait_eol(sim9_millis(), 1000)) {
+			rc = sim9_line.rc;
+			ok = (rc == SIM9_RC_MATCH);
+
+			if (rc != SIM9_RC_NONE)
+				sim9->rc = rc;
+
+			if (extbuff) {
+				strncpy(extbuff, sim9_line.buf, extsize);
+				extbuff[extsize - 1] = 0;
+			}
+
+#ifdef SIM9_DEBUG_PORT
+			sim9_debug_P(PSTR("<- "));
+			sim9_debug(sim9_line.buf);
+			sim9_debug_P(PSTR("\n"));
+#endif
+
+			sim9_line_next();
+
+			/* if I found a failure code and
+			 * it is not what I was looking for
+			 * then exit.
+			 */
+			if (check_error && sim9_rc_failed(rc))
+				count = 0;
+		}
+	} while (!ok && count--);
+
+	sim9_line_expect(NULL, FALSE, EQUAL);
+
+#ifdef SIM9_DEBUG_PORT
+	if (ok) {
+		sim9_debug_P(PSTR(" -[*]-\n"));
+	} else {
+		sim9_debug_P(PSTR(" -[NOTFOUND!]-\n"));
+		debug_usart_buffer();
+	}
+#endif
+
+	return(ok);
+}
+
+/*! Search for string from the modem.
+ *
+ * \see searchfor()
+ */
+uint8_t sim9_searchfor(const char *s, uint8_t count,
+		char *extbuff, const uint8_t extsize, const uint8_t type)
+{
+	return(searchfor(s, FALSE, count, extbuff, extsize, type));
+}
+
+/*! PROGMEM version of the searchfor().
+ *
+ * The string is matched directly in the flash space, it
+ * never occupies ram.
+ *
+ * \see searchfor()
+ */
+uint8_t sim9_searchfor_P(PGM_P s, uint8_t count,
+		char *extbuff, const uint8_t extsize, const uint8_t type)
+{
+	return(searchfor(s, TRUE, count, extbuff, extsize, type));
+}
+
+/*! Max response time of the commands.
+ *
+ * Matched by prefix, in order, against the command sent. The expect
+ * string, if not NULL, is the answer searched instead of OK by a
+ * SENDAT_TYPE_OK command with no expect string of its own.
+ * Commands not in the table use SIM9_AT_TIMEOUT.
+ */
+struct at_timeout_t {
+	PGM_P prefix;
+	PGM_P expect;
+	uint32_t timeout; // ms
+};
+
+static const char at_ciicr[] PROGMEM = "AT+CIICR";
+static const char at_cgatt[] PROGMEM = "AT+CGATT";
+static const char at_cipstart[] PROGMEM = "AT+CIPSTART";
+static const char at_cipshut[] PROGMEM = "AT+CIPSHUT";
+static const char at_cipclose[] PROGMEM = "AT+CIPCLOSE";
+static const char at_cpowd[] PROGMEM = "AT+CPOWD";
+static const char at_cops_set[] PROGMEM = "AT+COPS=";
+static const char at_cpin[] PROGMEM = "AT+CPIN";
+static const char at_cifsr[] PROGMEM = "AT+CIFSR";
+static const char at_cstt[] PROGMEM = "AT+CSTT";
+static const char at_connect_ok[] PROGMEM = "CONNECT OK";
+static const char at_shut_ok[] PROGMEM = "SHUT OK";
+static const char at_close_ok[] PROGMEM = "CLOSE OK";
+static const char at_power_down[] PROGMEM = "NORMAL POWER DOWN";
+
+static const struct at_timeout_t at_timeouts[] PROGMEM = {
+	{ at_ciicr, NULL, 85000 },
+	{ at_cgatt, NULL, 10000 },
+	{ at_cipstart, at_connect_ok, 75000 },
+	{ at_cipshut, at_shut_ok, 65000 },
+	{ at_cipclose, at_close_ok, 5000 },
+	{ at_cpowd, at_power_down, 5000 },
+	{ at_cops_set, NULL, 120000 },
+	{ at_cpin, NULL, 5000 },
+	{ at_cifsr, NULL, 2000 },
+	{ at_cstt, NULL, 2000 }
+};
+
+#define AT_TIMEOUTS_SIZE (sizeof(at_timeouts) / sizeof(struct at_timeout_t))
+
+/*! Does the command start with the flash prefix?
+ *
+ * \param cmd the command.
+ * \param progmem TRUE if cmd is a PROGMEM string.
+ * \param prefix the PROGMEM prefix.
+ * \return TRUE if it does.
+ */
+static uint8_t at_prefix(const char *cmd, const uint8_t progmem,
+		PGM_P prefix)
+{
+	char c, t;
+
+	while ((t = pgm_read_byte(prefix++))) {
+		c = progmem ? pgm_read_byte(cmd++) : *(cmd++);
+
+		if (c != t)
+			return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+/*! Set the timeout and the expected answer of a command from
+ * the at_timeouts table.
+ *
+ * \param c the command.
+ */
+static void at_lookup(struct sim9_cmd_t *c)
+{
+	uint8_t i;
+
+	c->timeout = SIM9_AT_TIMEOUT;
+
+	for (i = 0; i < AT_TIMEOUTS_SIZE; i++)
+		if (at_prefix(c->cmd, c->progmem,
+				(PGM_P)pgm_read_word(&at_timeouts[i].prefix))) {
+			c->timeout = pgm_read_dword(&at_timeouts[i].timeout);
+
+			if (!c->expect && c->type == SENDAT_TYPE_OK)
+				c->expect = (PGM_P)pgm_read_word(&at_timeouts[i].expect);
+
+			break;
+		}
+}
+
+/*! Start the command at the head of the queue.
+ *
+ * Lines still pending are already drained by sim9_poll(), so every
+ * line from now on belongs to this command.
+ */
+static void at_start(void)
+{
+	struct sim9_cmd_t *c;
+
+	c = &sim9_at.queue[sim9_at.head];
+	sim9_at.busy = TRUE;
+	sim9_at.captured = FALSE;
+
+	if (!c->timeout)
+		at_lookup(c);
+
+	/* the parser recognizes the echo of this command */
+	sim9_line_cmd(c->cmd, c->progmem);
+	sim9_line_expect(c->expect, TRUE, c->expect_type);
+
+	if (c->progmem)
+		sim9_send_P(c->cmd);
+	else
+		sim9_send(c->cmd);
+
+	sim9_send_P(PSTR("\r"));
+	sim9_at.start = sim9_millis();
+}
+
+/*! Complete the command in flight.
+ *
+ * \param rc the SIM9_RC_* result.
+ */
+static void at_done(const uint8_t rc)
+{
+	struct sim9_cmd_t c;
+	uint32_t ms;
+
+	ms = sim9_millis() - sim9_at.start;
+	sim9->stats.last = ms > 0xffff ? 0xffff : ms;
+	sim9->stats.total += ms;
+	sim9->stats.count++;
+
+	c = sim9_at.queue[sim9_at.head];
+	sim9_at.head = (sim9_at.head + 1) % SIM9_QUEUE_SIZE;
+	sim9_at.count--;
+	sim9_at.busy = FALSE;
+	sim9_at.done_seq = c.seq;
+	sim9_at.done_rc = rc;
+	sim9_line_cmd(NULL, FALSE);
+	sim9_line_expect(NULL, FALSE, EQUAL);
+
+	if (c.done)
+		c.done(rc, &c);
+}
+
+/*! Can CLOSED or CONNECT FAIL end the command?
+ *
+ * \param c the command in flight.
+ * \return TRUE for AT+CIPSTART, AT+CIPSEND and AT+CIPCLOSE.
+ */
+static uint8_t at_conn_cmd(const struct sim9_cmd_t *c)
+{
+	return(at_prefix(c->cmd, c->progmem, PSTR("AT+CIPSTART")) ||
+			at_prefix(c->cmd, c->progmem, PSTR("AT+CIPSEND")) ||
+			at_prefix(c->cmd, c->progmem, PSTR("AT+CIPCLOSE")));
+}
+
+/*! A line is received for the command in flight.
+ *
+ * Answers (type field) can be:
+ *
+ * SENDAT_TYPE_NONE:
+ *    No Answer.
+ *
+ * SENDAT_TYPE_OK:
+ *    [CR][LF]OK[CR][LF]
+ *    or the expect string, if not NULL.
+ *
+ * SENDAT_TYPE_MSGOK:
+ *    [CR][LF]<something>[CR][LF]
+ *    [CR][LF]OK[CR][LF]
+ *    the <something> is copied to msg.
+ *
+ * SENDAT_TYPE_MSG:
+ *    [CR][LF]<something>[CR][LF]
+ *    the <something> is copied to msg, if msg is NULL it is
+ *    left in the parser, \see sim9_line_view().
+ *
+ * A failure final result code completes any command.
+ */
+static void at_line(void)
+{
+	struct sim9_cmd_t *c;
+	uint8_t rc;
+
+	c = &sim9_at.queue[sim9_at.head];
+	rc = sim9_line.rc;
+
+	/* With the echo on, lines before the echo are leftovers
+	 * of a previous command.
+	 */
+	if (sim9->status.echo && !sim9_line.echoed)
+		return;
+
+	/* otherwise an URC, the connection dropped */
+	if ((rc == SIM9_RC_CLOSED || rc == SIM9_RC_CONNECT_FAIL) &&
+			!at_conn_cmd(c))
+		return;
+
+	if (rc != SIM9_RC_NONE)
+		sim9->rc = rc;
+
+	if (sim9_rc_failed(rc)) {
+		at_done(rc);
+		return;
+	}
+
+	switch (c->type) {
+		case SENDAT_TYPE_MSG:
+			if (c->msg) {
+				strncpy(c->msg, sim9_line.buf, c->size);
+				c->msg[c->size - 1] = 0;
+			} else {
+				sim9_line.held = TRUE;
+			}
+
+			at_done(SIM9_RC_OK);
+			break;
+		case SENDAT_TYPE_MSGOK:
+			if (!sim9_at.captured && rc == SIM9_RC_NONE) {
+				if (c->msg) {
+					strncpy(c->msg, sim9_line.buf, c->size);
+					c->msg[c->size - 1] = 0;
+				}
+
+				sim9_at.captured = TRUE;
+				break;
+			}
+		case SENDAT_TYPE_OK:
+		default:
+			if (rc == SIM9_RC_MATCH || (!c->expect && rc == SIM9_RC_OK)) {
+				if (c->type == SENDAT_TYPE_MSGOK && !sim9_at.captured)
+					rc = SIM9_RC_ERROR;
+
+				at_done(rc);
+			}
+
+			break;
+	}
+}
+
+/*! Queue an AT command.
+ *
+ * The command is sent and its answer processed by sim9_poll().
+ * The strings and msg buffer must stay valid until the command
+ * is completed.
+ *
+ * With a 0 timeout, the timeout and the expected answer are taken
+ * from the per command table, \see at_timeouts.
+ *
+ * \param c the command, it is copied in the queue.
+ * \return the sequence number of the command, 0 if the queue is full.
+ */
+uint8_t sim9_at_submit(const struct sim9_cmd_t *c)
+{
+	uint8_t i;
+
+	if (sim9_at.count == SIM9_QUEUE_SIZE)
+		return(0);
+
+	i = (sim9_at.head + sim9_at.count) % SIM9_QUEUE_SIZE;
+	sim9_at.queue[i] = *c;
+
+	/* 0 is not a valid sequence */
+	if (!++sim9_at.seq)
+		sim9_at.seq++;
+
+	sim9_at.queue[i].seq = sim9_at.seq;
+	sim9_at.count++;
+	return(sim9_at.seq);
+}
+
+/*! Is the command engine busy?
+ *
+ * \return TRUE if commands are in flight or queued.
+ */
+uint8_t sim9_at_busy(void)
+{
+	return(sim9_at.count ? TRUE : FALSE);
+}
+
+/*! RI pin change.
+ *
+ * The modem pulls RI low on incoming calls, SMS, data and URCs,
+ * also from the sleep mode. The event wakes the cpu up, the URC
+ * is then dispatched by sim9_poll().
+ */
+void sim9_ri_irq(void)
+{
+	if (!(PINA & _BV(SIM9_RI)))
+		sim9->events |= (1UL << SIM9_EVENT_RI);
+}
+
+#ifndef SIM9_NO_RI_IRQ
+ISR(SIM9_RI_vect)
+{
+	sim9_ri_irq();
+}
+#endif
+
+/*! Wake the modem up before a command.
+ *
+ * \return TRUE if the modem can receive a command.
+ */
+static uint8_t at_awake(void)
+{
+	if (sim9->status.sleep) {
+		PORTA &= ~_BV(SIM9_DTR);
+		sim9->status.sleep = FALSE;
+		sim9_at.wake = sim9_millis();
+		sim9_at.waking = TRUE;
+	}
+
+	if (sim9_at.waking &&
+			!sim9_expired(sim9_at.wake, SIM9_WAKE_DELAY))
+		return(FALSE);
+
+	sim9_at.waking = FALSE;
+	return(TRUE);
+}
+
+/*! Max bytes in one AT+CIPSEND. */
+static uint16_t cipsend_size(void)
+{
+	if (sim9_cipsend.max && sim9_cipsend.max < SIM9_SEND_SIZE)
+		return(sim9_cipsend.max);
+	else
+		return(SIM9_SEND_SIZE);
+}
+
+/*! End of an AT+CIPSEND, the bytes in flight are removed.
+ *
+ * On failure they are lost, the next ones are sent anyway.
+ */
+static void cipsend_done(const uint8_t rc)
+{
+	sim9_line_expect(NULL, FALSE, EQUAL);
+	sim9_line.prompt = FALSE;
+
+	if (sim9_rc_failed(rc))
+		sim9_cipsend.rc = rc;
+
+	sim9_cipsend.len -= sim9_cipsend.n;
+	memmove(sim9_cipsend.buf, sim9_cipsend.buf + sim9_cipsend.n,
+			sim9_cipsend.len);
+	sim9_cipsend.n = 0;
+	sim9_cipsend.state = SIM9_CIPSEND_IDLE;
+
+	if (!sim9_cipsend.len)
+		sim9_cipsend.flush = FALSE;
+}
+
+/*! AT+CIPSEND=<len> sent, the '>' follows. */
+static void cipsend_cmd_done(const uint8_t rc, const struct sim9_cmd_t *c)
+{
+	sim9_cipsend.state = SIM9_CIPSEND_PROMPT;
+	sim9_cipsend.sent = sim9_millis();
+}
+
+/*! Queue the AT+CIPSEND=<len> of the bytes buffered. */
+static void cipsend_start(void)
+{
+	struct sim9_cmd_t c;
+
+	sim9_cipsend.n = sim9_cipsend.len;
+	strcpy_P(sim9_cipsend.cmd, PSTR("AT+CIPSEND="));
+	utoa(sim9_cipsend.n, sim9_cipsend.cmd + 11, 10);
+	sim9_line.prompt = FALSE;
+
+	c.cmd = sim9_cipsend.cmd;
+	c.expect = NULL;
+	c.msg = NULL;
+	c.done = cipsend_cmd_done;
+	c.timeout = SIM9_AT_TIMEOUT;
+	c.size = 0;
+	c.type = SENDAT_TYPE_NONE;
+	c.expect_type = EEQUAL;
+	c.progmem = FALSE;
+
+	if (sim9_at_submit(&c))
+		sim9_cipsend.state = SIM9_CIPSEND_CMD;
+}
+
+/*! A line during the AT+CIPSEND. */
+static void cipsend_line(void)
+{
+	if ((sim9_cipsend.state == SIM9_CIPSEND_DATA) &&
+			(sim9_line.rc == SIM9_RC_MATCH))
+		cipsend_done(SIM9_RC_OK);
+	else if (sim9_rc_failed(sim9_line.rc))
+		cipsend_done(sim9_line.rc);
+}
+
+/*! Drive the AT+CIPSEND.
+ *
+ * The buffer is sent when full, on the deadline or on sim9_flush(),
+ * with the command engine idle. The data go after the '>' prompt
+ * and the send ends on SEND OK, on error or timeout.
+ */
+static void cipsend_poll(void)
+{
+	uint16_t i;
+
+	switch (sim9_cipsend.state) {
+		case SIM9_CIPSEND_IDLE:
+			if (!sim9_cipsend.len)
+				break;
+
+			/* nowhere to send them */
+			if (sim9->status.tcpip != SIM9_TCPIP_CONNECT_OK) {
+				sim9_cipsend.n = sim9_cipsend.len;
+				cipsend_done(SIM9_RC_CLOSED);
+				break;
+			}
+
+			if (!sim9_at.busy && !sim9_at.count &&
+					(sim9_cipsend.flush ||
+					 sim9_cipsend.len >= cipsend_size() ||
+					 sim9_expired(sim9_cipsend.start,
+						 SIM9_SEND_DEADLINE)))
+				cipsend_start();
+
+			break;
+		case SIM9_CIPSEND_PROMPT:
+			if (sim9_line.prompt) {
+				sim9_line.prompt = FALSE;
+
+				for (i = 0; i < sim9_cipsend.n; i++)
+					sim9_putchar(sim9_cipsend.buf[i]);
+
+				sim9_line_expect(PSTR("SEND OK"), TRUE, EEQUAL);
+				sim9_cipsend.state = SIM9_CIPSEND_DATA;
+				sim9_cipsend.sent = sim9_millis();
+			} else if (sim9_expired(sim9_cipsend.sent,
+						SIM9_AT_TIMEOUT)) {
+				cipsend_done(SIM9_RC_TIMEOUT);
+			}
+
+			break;
+		case SIM9_CIPSEND_DATA:
+			if (sim9_expired(sim9_cipsend.sent, SIM9_SEND_TIMEOUT))
+				cipsend_done(SIM9_RC_TIMEOUT);
+	}
+}
+
+/*! Drive the command engine, call it from the main loop.
+ *
+ * Drain the lines received, complete the command in flight on its
+ * answer or timeout and start the next one. It never blocks.
+ */
+void sim9_poll(void)
+{
+	while (!sim9_line.held && sim9_rx_poll()) {
+		if (sim9_at.busy)
+			at_line();
+		else if (sim9_cipsend.state >= SIM9_CIPSEND_PROMPT)
+			cipsend_line();
+
+		if (!sim9_line.held)
+			sim9_line_next();
+	}
+
+	if (sim9_at.busy && sim9_expired(sim9_at.start,
+				sim9_at.queue[sim9_at.head].timeout))
+		at_done(SIM9_RC_TIMEOUT);
+
+	/* the connection timed out */
+	if ((sim9->status.tcpip == SIM9_TCPIP_CONNECTING) &&
+			sim9_expired(sim9_conn.start, sim9_conn.timeout))
+		sim9->status.tcpip = SIM9_TCPIP_CLOSED;
+
+	cipsend_poll();
+
+	/* no command between the AT+CIPSEND and its SEND OK */
+	if (!sim9_at.busy && sim9_at.count &&
+			(sim9_cipsend.state < SIM9_CIPSEND_PROMPT) &&
+			at_awake()) {
+		at_start();
+
+		if (sim9_at.queue[sim9_at.head].type == SENDAT_TYPE_NONE)
+			at_done(SIM9_RC_OK);
+	}
+}
+
+/*! Queue an AT command and wait for its completion.
+ *
+ * The cpu sleeps while waiting.
+ *
+ * \param c the command.
+ * \return the SIM9_RC_* result.
+ */
+uint8_t sim9_at_run(const struct sim9_cmd_t *c)
+{
+	uint8_t seq;
+
+	while (!(seq = sim9_at_submit(c))) {
+		sim9_poll();
+		sim9_idle();
+	}
+
+	sim9_poll();
+
+	while (sim9_at.done_seq != seq) {
+		sim9_idle();
+		sim9_poll();
+	}
+
+	return(sim9_at.done_rc);
+}
+
+/* Send an AT command to the device and wait for the answer.
+ *
+ * A blocking wrapper over the command engine.
+ *
+ * \note the echo, if enabled, is suppressed by the line parser.
+ *
+ * \param cmd the command with AT.
+ * \param progmem TRUE if cmd is a PROGMEM string.
+ * \param msg the <something> needed back.
+ * \param size the size of msg.
+ * \param type the type of answer, \see at_line().
+ * \return TRUE if the command succeeded.
+ */
+static uint8_t send_at(const char* cmd, const uint8_t progmem,
+		char* msg, const uint8_t size, const uint8_t type)
+{
+	struct sim9_cmd_t c;
+	uint8_t rc;
+
+	c.cmd = cmd;
+	c.expect = NULL;
+	c.msg = msg;
+	c.done = NULL;
+	c.timeout = 0;
+	c.size = size;
+	c.type = type;
+	c.expect_type = EEQUAL;
+	c.progmem = progmem;
+
+	rc = sim9_at_run(&c);
+	return(rc == SIM9_RC_OK || rc == SIM9_RC_MATCH);
+}
+
+/*! Send an AT command to the device.
+ *
+ * \see send_at()
+ */
+uint8_t sim9_send_at(const char* cmd, char* msg,
+		const uint8_t size, const uint8_t type)
+{
+	return(send_at(cmd, FALSE, msg, size, type));
+}
+
+/*! PROGMEM version of the send_at()
+ *
+ * The command is streamed from the flash to the usart and
+ * the echo is matched in the flash, nothing is copied to ram.
+ *
+ * \see send_at()
+ */
+uint8_t sim9_send_at_P(PGM_P cmd, char* msg,
+		const uint8_t msgsize, const uint8_t type)
+{
+	return(send_at(cmd, TRUE, msg, msgsize, type));
+}
+
+/*! Set the command echo of the modem.
+ *
+ * With the echo off (ATE0) no echo bytes are exchanged and the
+ * answers are correlated to the command in flight only by the
+ * queue order. With the echo on (ATE1) the lines received before
+ * the echo of the command in flight are discarded.
+ *
+ * \param enable TRUE echo on, FALSE echo off.
+ * \return TRUE if the modem accepted it.
+ */
+uint8_t sim9_echo(const uint8_t enable)
+{
+	uint8_t ok;
+
+	sim9->echo_ena = enable;
+
+	if (enable)
+		ok = sim9_send_at_P(PSTR("ATE1"), NULL, 0, SENDAT_TYPE_OK);
+	else
+		ok = sim9_send_at_P(PSTR("ATE0"), NULL, 0, SENDAT_TYPE_OK);
+
+	/* the echo is known only if the modem accepted the command */
+	if (ok)
+		sim9->status.echo = enable;
+
+	return(ok);
+}
+
+/*! Append a command to the batch line.
+ *
+ * \param len the length of the line.
+ * \param cmd the PROGMEM command without AT.
+ * \param sep TRUE if a ';' must precede it.
+ * \return the new length, 0 if it does not fit.
+ */
+static uint8_t batch_add(uint8_t len, PGM_P cmd, const uint8_t sep)
+{
+	if ((len + sep + strlen_P(cmd)) >= SIM9_BATCH_LINE)
+		return(0);
+
+	if (sep)
+		sim9_batch[len++] = ';';
+
+	strcpy_P(sim9_batch + len, cmd);
+	return(len + strlen_P(cmd));
+}
+
+/*! Send a batch of configuration commands.
+ *
+ * The commands are concatenated on as few command lines as
+ * SIM9_BATCH_LINE allows, ex. "AT&F&C0&D0+SLEDS=1,53,790;+CNETLIGHT=1".
+ * Extended (+) commands are followed by ';'.
+ *
+ * The modem stops a line at the first failing command, in that case
+ * the commands of the line are sent one by one, a failing command
+ * does not stop the others. Only idempotent commands, like the
+ * configuration ones, can be batched.
+ *
+ * \param cmds PROGMEM array of PROGMEM commands without AT.
+ * \param n number of commands.
+ * \return the number of commands succeeded, n if all.
+ */
+uint8_t sim9_send_batch_P(PGM_P const *cmds, const uint8_t n)
+{
+	PGM_P cmd;
+	uint8_t first, i, len, next, ext, ok;
+
+	first = 0;
+	ok = 0;
+
+	while (first < n) {
+		strcpy_P(sim9_batch, PSTR("AT"));
+		len = 2;
+		ext = FALSE;
+
+		for (i = first; i < n; i++) {
+			cmd = (PGM_P)pgm_read_word(&cmds[i]);
+			next = batch_add(len, cmd, ext);
+
+			if (!next)
+				break;
+
+			len = next;
+			ext = (pgm_read_byte(cmd) == '+');
+		}
+
+		/* a command longer than the line, failed */
+		if (i == first) {
+			first++;
+			continue;
+		}
+
+		if (sim9_send_at(sim9_batch, NULL, 0, SENDAT_TYPE_OK)) {
+			ok += i - first;
+		} else {
+			/* one by one, the failing ones are skipped */
+			for (; first < i; first++) {
+				cmd = (PGM_P)pgm_read_word(&cmds[first]);
+				batch_add(2, cmd, FALSE);
+
+				if (sim9_send_at(sim9_batch, NULL, 0,
+							SENDAT_TYPE_OK))
+					ok++;
+			}
+		}
+
+		first = i;
+	}
+
+	return(ok);
+}
+
+/*! Send a SENDAT_TYPE_MSGOK command and view the answer.
+ *
+ * The <something> is not copied, it can be inspected in place
+ * until sim9_view_end() is called.
+ *
+ * \param cmd the PROGMEM command with AT.
+ * \param v the view of the <something>.
+ * \return TRUE if the <something> is available.
+ */
+uint8_t sim9_send_at_view_P(PGM_P cmd, struct sim9_view_t *v)
+{
+	if (send_at(cmd, TRUE, NULL, 0, SENDAT_TYPE_MSG)) {
+		v->s = sim9_line.buf;
+		v->len = sim9_line.len;
+		return(TRUE);
+	}
+
+	return(FALSE);
+}
+
+/*! Release the view and search for the final OK.
+ *
+ * \return TRUE if OK is found.
+ */
+uint8_t sim9_view_end(void)
+{
+	sim9_line_release();
+	return(sim9_searchfor_P(PSTR("OK"), SIM9_AT_COUNT,
+				NULL, 0, EEQUAL));
+}
+
+/*! Run a script.
+ *
+ * Every step is read from the flash and tried up to retry times,
+ * its error flag, if any, is cleared on success and set on failure.
+ * The script goes on with the ok or fail step until SIM9_STEP_END.
+ * A step is skipped, as succeeded, if its status flag is already set.
+ *
+ * \param script PROGMEM array of steps.
+ * \param step the first step to run.
+ * \return TRUE if the last step succeeded.
+ */
+uint8_t sim9_script_P(const struct sim9_step_t *script, uint8_t step)
+{
+	struct sim9_step_t st;
+	struct sim9_cmd_t c;
+	uint8_t ok, retry, rc;
+
+	ok = TRUE;
+
+	while (step != SIM9_STEP_END) {
+		memcpy_P(&st, &script[step], sizeof(struct sim9_step_t));
+
+		if ((st.skip != SIM9_STEP_NONE) &&
+				(sim9->status.all & _BV(st.skip))) {
+			step = st.ok;
+			continue;
+		}
+
+		retry = st.retry;
+		ok = FALSE;
+
+		while (!ok && retry--) {
+			sim9_delay_ms(st.delay);
+			ok = TRUE;
+
+			if (st.cmd) {
+				c.cmd = st.cmd;
+				c.expect = st.expect;
+				c.msg = NULL;
+				c.done = NULL;
+				c.timeout = st.timeout;
+				c.size = 0;
+				c.type = st.type;
+				c.expect_type = st.expect_type;
+				c.progmem = TRUE;
+
+				rc = sim9_at_run(&c);
+				ok = (rc == SIM9_RC_OK || rc == SIM9_RC_MATCH);
+
+				/* the answer is not used */
+				if (ok && st.type == SENDAT_TYPE_MSG)
+					sim9_line_release();
+			}
+
+			if (ok && st.check)
+				ok = st.check();
+		}
+
+		if (st.error != SIM9_STEP_NONE) {
+			if (ok)
+				sim9->errors.all &= ~_BV(st.error);
+			else
+				sim9->errors.all |= _BV(st.error);
+		}
+
+		if (ok)
+			step = st.ok;
+		else
+			step = st.fail;
+	}
+
+	return(ok);
+}
+
+/*! Send the '+' held by sim9_stream_write().
+ */
+static void stream_flush(void)
+{
+	while (sim9_stream.plus) {
+		sim9_putchar('+');
+		sim9_stream.plus--;
+	}
+
+	sim9_stream.last = sim9_millis();
+}
+
+/*! send the escape sequence to the modem.
+ *
+ * there should be 1000ms idle period before this sequence, 500ms idle
+ * period after this sequence and no more then 500ms between each +.
+ */
+void sim9_escape(void)
+{
+	uint8_t retry=3;
+
+	while (retry--) {
+		if (sim9->status.connected) {
+			stream_flush();
+
+			/* only the idle time left */
+			while (!sim9_expired(sim9_stream.last, SIM9_ESC_GUARD))
+				sim9_idle();
 
-	while (retry--) {
-		if (sim9->status.connected) {
-			_delay_ms(1000);
 			sim9_send_P(PSTR("+++"));
-			_delay_ms(500);
+			sim9_delay_ms(500);
+			/* command mode, the parser restarts */
+			sim9->status.connected = FALSE;
+			sim9_stream.last = sim9_millis();
 
 			/* send only to buffer the +++ with EOL */
 			if (sim9->status.echo) {
@@ -500,7 +2192,7 @@ void sim9_escape(void)
 						NULL, 0, EQUAL);
 			} else {
 				/* Long delays may happen */
-				_delay_ms(1000);
+				sim9_delay_ms(1000);
 			}
 		}
 
@@ -526,259 +2218,862 @@ void sim9_escape(void)
  *
  * \note the response is <CR><LF>imei<CR><LF>
  * you need to skip the 1st message.
+ * \return TRUE if the IMEI is read.
  */
-void imei(void)
+uint8_t imei(void)
 {
-	uint8_t retry=10;
-
 	*(sim9->imei) = 0;
-	sim9->errors.imei = TRUE;
 	sim9_clear_rx_buff();
 
-	while (sim9->errors.imei && retry--)
-		if (sim9_send_at_P(PSTR("AT+CGSN"),
-					sim9->imei, IMEI_SIZE,
-					SENDAT_TYPE_MSGOK) &&
-				(strlen(sim9->imei) > 14))
-			sim9->errors.imei = FALSE;
+	return(sim9_send_at_P(PSTR("AT+CGSN"), sim9->imei, IMEI_SIZE,
+				SENDAT_TYPE_MSGOK) &&
+			(strlen(sim9->imei) > 14));
 }
 
-/* check for the SIM pin */
-void pin_check(void)
+/*! crc16 of the identity strings.
+ *
+ * \param id the identity.
+ * \return the crc.
+ */
+static uint16_t ident_crc(const struct sim9_ident_t *id)
 {
-#define SOB2 20 /* temp size of buffer */
+	const uint8_t *p;
+	uint16_t crc;
 
-	char *buffer;
+	crc = 0xffff;
 
-	buffer = malloc(SOB2);
+	for (p = (const uint8_t *)id; p < (const uint8_t *)&id->crc; p++)
+		crc = _crc16_update(crc, *p);
 
-	if (sim9_send_at_P(PSTR("AT+CPIN?"),
-				buffer, SOB2,
-				SENDAT_TYPE_MSGOK) &&
-			!memcmp_P(buffer, PSTR("+CPIN: READY"), 12))
-		sim9->errors.pin = FALSE;
+	return(crc);
+}
+
+/*! Load the identity from the EEPROM cache.
+ *
+ * \return TRUE if the cache is valid.
+ */
+static uint8_t ident_load(void)
+{
+	struct sim9_ident_t id;
+
+	eeprom_read_block(&id, &sim9_ee_ident, sizeof(struct sim9_ident_t));
+
+	if (id.crc != ident_crc(&id))
+		return(FALSE);
+
+	strncpy(sim9->imei, id.imei, IMEI_SIZE);
+	strncpy(sim9->gmr, id.gmr, GMR_SIZE);
+	strncpy(sim9->model, id.model, MODEL_SIZE);
+	return(TRUE);
+}
+
+/*! Check the modem identity.
+ *
+ * The IMEI is read, if it is the cached one the firmware revision
+ * and the model are taken from the cache, otherwise they are read
+ * and the cache is updated.
+ *
+ * \return TRUE if the identity is known.
+ */
+uint8_t sim9_ident(void)
+{
+	struct sim9_ident_t id;
+
+	if (!imei())
+		return(FALSE);
+
+	eeprom_read_block(&id, &sim9_ee_ident, sizeof(struct sim9_ident_t));
+
+	/* the same modem */
+	if ((id.crc == ident_crc(&id)) &&
+			!strncmp(id.imei, sim9->imei, IMEI_SIZE)) {
+		strncpy(sim9->gmr, id.gmr, GMR_SIZE);
+		strncpy(sim9->model, id.model, MODEL_SIZE);
+		return(TRUE);
+	}
+
+	*(sim9->gmr) = 0;
+	*(sim9->model) = 0;
+
+	if (!sim9_send_at_P(PSTR("AT+GMR"), sim9->gmr, GMR_SIZE,
+				SENDAT_TYPE_MSGOK) ||
+			!sim9_send_at_P(PSTR("AT+CGMM"), sim9->model,
+				MODEL_SIZE, SENDAT_TYPE_MSGOK))
+		return(FALSE);
+
+	memset(&id, 0, sizeof(struct sim9_ident_t));
+	strncpy(id.imei, sim9->imei, IMEI_SIZE - 1);
+	strncpy(id.gmr, sim9->gmr, GMR_SIZE - 1);
+	strncpy(id.model, sim9->model, MODEL_SIZE - 1);
+	id.crc = ident_crc(&id);
+	eeprom_update_block(&id, &sim9_ee_ident, sizeof(struct sim9_ident_t));
+	return(TRUE);
+}
+
+/*! check for the SIM pin
+ *
+ * \return TRUE if the SIM is ready.
+ */
+uint8_t pin_check(void)
+{
+	struct sim9_view_t v;
+	uint8_t ready;
+
+	if (sim9_send_at_view_P(PSTR("AT+CPIN?"), &v)) {
+		ready = sim9_view_P(&v, PSTR("+CPIN: READY"));
+		return(sim9_view_end() && ready);
+	}
+
+	return(FALSE);
+}
+
+/*! Wait for the network registration.
+ *
+ * The registration is tracked by the +CGREG URC, the query, sent
+ * every SIM9_REG_POLL, refreshes it. Returns as soon as registered.
+ *
+ * \return TRUE if registered, home or roaming.
+ */
+uint8_t network_registered(void)
+{
+	uint32_t start, query;
+
+	start = sim9_millis();
+	query = start - SIM9_REG_POLL;
+
+	while (!reg_ok(sim9->reg.cgreg)) {
+		if (sim9_expired(start, SIM9_REG_TIMEOUT))
+			return(FALSE);
+
+		/* without +CGREG=2 no URC comes, the answer is parsed
+		 * as the URC.
+		 */
+		if (sim9_expired(query, SIM9_REG_POLL)) {
+			sim9_send_at_P(PSTR("AT+CGREG?"), NULL, 0,
+					SENDAT_TYPE_OK);
+			query = sim9_millis();
+		}
+
+		sim9_wait_event(SIM9_URC_CGREG, SIM9_AT_TIMEOUT);
+	}
+
+	return(TRUE);
+}
+
+void sim9_suspend(void)
+{
+	usart_suspend(SIM9_SERIAL_PORT);
+}
+
+void sim9_resume(void)
+{
+	usart_resume(SIM9_SERIAL_PORT);
+}
+
+/*! \brief Initialize the serial port if requested.
+ *
+ * Also allocate the RXTX struct buffer and start the TIMER2
+ * millisecond time base, unless an external one is set with
+ * sim9_set_clock().
+ *
+ * \note if the IRQ is used, then it must be already enabled.
+ * \warning flags will be cleared on every sim9_on()
+ */
+struct sim9_t* sim9_init(void)
+{
+	if (!sim9) {
+#ifdef SIM9_NO_MALLOC
+		sim9 = &sim9_struct;
+		sim9->imei = sim9_imei;
+		sim9->gmr = sim9_gmr;
+		sim9->model = sim9_model;
+		sim9->gps_lat = sim9_gps_lat;
+		sim9->gps_lon = sim9_gps_lon;
+#else
+		sim9 = malloc(sizeof(struct sim9_t));
+		/* allocate the IMEI string */
+		sim9->imei = malloc(IMEI_SIZE);
+		/* allocate the identity strings */
+		sim9->gmr = malloc(GMR_SIZE);
+		sim9->model = malloc(MODEL_SIZE);
+		/* allocate the GSP strings */
+		sim9->gps_lat = malloc(GPS_LAT_SIZE);
+		sim9->gps_lon = malloc(GPS_LON_SIZE);
+#endif
+		/* clear flags */
+		sim9->status.all = 0;
+		sim9->errors.all = 0;
+		sim9->flags = 0;
+
+#ifdef SIM9_ECHO_ENA
+		sim9->echo_ena = TRUE;
+#endif
+
+		sim9->baud = SIM9_USART_BAUD;
+		sim9->rc = SIM9_RC_NONE;
+
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			sim9->events = 0;
+		}
+
+		sim9->urc_handler = NULL;
+		memset(&sim9->stats, 0, sizeof(sim9->stats));
+		memset(&sim9->reg, 0, sizeof(sim9->reg));
+		*(sim9->imei) = 0;
+		*(sim9->gmr) = 0;
+		*(sim9->model) = 0;
+		/* the identity is known before the modem answers */
+		ident_load();
+		*(sim9->gps_lat) = 0;
+		*(sim9->gps_lon) = 0;
+		/* initialize the usart port */
+		sim9->usart = usart_init(SIM9_SERIAL_PORT);
+		/* start the millisecond time base, if TIMER2 */
+		sim9_timer_init();
+		/* convenient link to the TX buffer */
+		sim9->tx_buf = sim9->usart->tx;
+	}
+
+	return(sim9);
+}
+
+/*! remove all the allocated struct
+ */
+void sim9_shut(void)
+{
+	usart_shut(SIM9_SERIAL_PORT);
+	sim9->tx_buf = NULL;
+	sim9->usart = NULL;
+#ifndef SIM9_NO_MALLOC
+	free(sim9->gps_lon);
+	free(sim9->gps_lat);
+	free(sim9->model);
+	free(sim9->gmr);
+	free(sim9->imei);
+	free(sim9);
+#endif
+	sim9 = NULL;
+}
+
+/*! Commands sent before the Call Ready.
+ * enable URC presentation
+ */
+static const char cfg_ciurc[] PROGMEM = "+CIURC=1";
+
+static PGM_P const cfg_boot[] PROGMEM = {
+	cfg_ciurc
+};
+
+/*! Configuration, the factory default must be the first one.
+ * Net light behaviour.
+ */
+static const char cfg_factory[] PROGMEM = "&F&C0&D0";
+static const char cfg_sleds1[] PROGMEM = "+SLEDS=1,53,790";
+static const char cfg_sleds2[] PROGMEM = "+SLEDS=2,53,2990";
+static const char cfg_sleds3[] PROGMEM = "+SLEDS=3,53,287";
+static const char cfg_cnetlight[] PROGMEM = "+CNETLIGHT=1";
+/* registration URCs with LAC and CI */
+static const char cfg_creg[] PROGMEM = "+CREG=2";
+static const char cfg_cgreg[] PROGMEM = "+CGREG=2";
+/* DTR controlled sleep mode */
+static const char cfg_csclk[] PROGMEM = "+CSCLK=1";
+#ifdef SIM9_FLOW_CTRL
+/* RTS/CTS flow control */
+static const char cfg_ifc[] PROGMEM = "+IFC=2,2";
+#endif
+
+static PGM_P const cfg_setup[] PROGMEM = {
+	cfg_factory,
+	cfg_sleds1,
+	cfg_sleds2,
+	cfg_sleds3,
+	cfg_cnetlight,
+	cfg_creg,
+	cfg_cgreg,
+	cfg_csclk,
+#ifdef SIM9_FLOW_CTRL
+	cfg_ifc,
+#endif
+};
+
+/*! USART speeds, the fastest first */
+static const uint32_t baud_rates[] PROGMEM = {
+	115200, 57600, 38400, 19200, 9600
+};
+
+#define BAUD_RATES (sizeof(baud_rates) / sizeof(uint32_t))
+
+/*! UBRR value in double speed mode.
+ *
+ * \param baud the speed.
+ * \return the UBRR.
+ */
+static uint16_t baud_ubrr(const uint32_t baud)
+{
+	return((F_CPU + 4 * baud) / (8 * baud) - 1);
+}
+
+/*! Speed error with F_CPU.
+ *
+ * \param baud the speed.
+ * \return the error per thousand.
+ */
+static uint16_t baud_error(const uint32_t baud)
+{
+	uint32_t real;
+
+	real = F_CPU / (8 * ((uint32_t)baud_ubrr(baud) + 1));
+
+	if (real > baud)
+		return((real - baud) * 1000 / baud);
 	else
-		sim9->errors.pin = TRUE;
+		return((baud - real) * 1000 / baud);
+}
+
+/*! Change the USART speed.
+ *
+ * \param baud the speed.
+ */
+static void baud_set(const uint32_t baud)
+{
+	/* let the last byte out */
+	sim9_delay_ms(2);
+	SIM9_UCSRA |= _BV(SIM9_U2X);
+	SIM9_UBRR = baud_ubrr(baud);
+	sim9->baud = baud;
+	sim9_clear_rx_buff();
+}
+
+/*! Sync with the modem.
+ *
+ * \param retry tries.
+ * \return TRUE if the modem answered.
+ */
+static uint8_t baud_sync(uint8_t retry)
+{
+	while (retry--)
+		if (sim9_send_at_P(PSTR("AT"), NULL, 0, SENDAT_TYPE_OK))
+			return(TRUE);
+
+	return(FALSE);
+}
+
+/*! Send the AT+IPR command.
+ *
+ * \param baud the speed.
+ * \param wait TRUE to wait for the answer.
+ * \return TRUE if the modem answered.
+ */
+static uint8_t baud_ipr(const uint32_t baud, const uint8_t wait)
+{
+	strcpy_P(sim9_batch, PSTR("AT+IPR="));
+	ultoa(baud, sim9_batch + 7, 10);
+
+	if (wait)
+		return(sim9_send_at(sim9_batch, NULL, 0, SENDAT_TYPE_OK));
+
+	sim9_send(sim9_batch);
+	sim9_send_P(PSTR("\r"));
+	sim9_delay_ms(100);
+	return(TRUE);
+}
+
+/*! The speed saved with the profile.
+ *
+ * \return the speed, 0 if none or not usable.
+ */
+static uint32_t baud_saved(void)
+{
+	uint32_t baud;
+	uint8_t i;
+
+	baud = eeprom_read_dword(&sim9_ee_profile.baud);
+
+	for (i = 0; i < BAUD_RATES; i++)
+		if (baud == pgm_read_dword(&baud_rates[i]))
+			return(baud);
+
+	return(0);
+}
+
+/*! Find the modem speed.
+ *
+ * The speed saved with the profile first, the modem is fixed at it
+ * after the AT&W, then the last speed used, it may take a while
+ * after the power on, then all the others.
+ *
+ * \return TRUE if the modem answered.
+ */
+uint8_t sim9_baud_probe(void)
+{
+	uint32_t baud;
+	uint8_t i;
+
+	baud = baud_saved();
+
+	if (baud && (baud != sim9->baud)) {
+		baud_set(baud);
+
+		if (baud_sync(2))
+			return(TRUE);
+	}
+
+	baud_set(sim9->baud);
+
+	if (baud_sync(10))
+		return(TRUE);
+
+	for (i = 0; i < BAUD_RATES; i++) {
+		baud_set(pgm_read_dword(&baud_rates[i]));
+
+		if (baud_sync(2))
+			return(TRUE);
+	}
+
+	return(FALSE);
+}
+
+/*! Modem fixed speed.
+ *
+ * \return the AT+IPR speed, 0 for autobauding.
+ */
+static uint32_t baud_fixed(void)
+{
+	struct sim9_view_t v;
+	uint32_t ipr;
+	uint8_t i;
+
+	ipr = 0;
+
+	if (sim9_send_at_view_P(PSTR("AT+IPR?"), &v)) {
+		if (sim9_view_P(&v, PSTR("+IPR: ")))
+			for (i = 6; i < v.len &&
+					v.s[i] >= '0' && v.s[i] <= '9'; i++)
+				ipr = ipr * 10 + v.s[i] - '0';
+
+		sim9_view_end();
+	}
+
+	return(ipr);
+}
+
+/*! Switch to the fastest speed possible.
+ *
+ * The modem answers the AT+IPR at the old speed, then both sides
+ * change and the new speed is checked, on errors the next slower
+ * one is tried. The speed is saved with the profile.
+ *
+ * \return TRUE if the modem runs at a fixed speed.
+ */
+uint8_t sim9_baud_cfg(void)
+{
+	uint32_t old, baud;
+	uint8_t i;
+
+	old = sim9->baud;
+
+	for (i = 0; i < BAUD_RATES; i++) {
+		baud = pgm_read_dword(&baud_rates[i]);
+
+		if ((baud > SIM9_BAUD) ||
+				(baud_error(baud) > SIM9_BAUD_ERROR))
+			continue;
+
+		if (baud == old) {
+			if (baud_fixed() == baud)
+				return(TRUE);
+			else
+				return(baud_ipr(baud, TRUE));
+		}
+
+		if (!baud_ipr(baud, TRUE))
+			continue;
+
+		baud_set(baud);
+
+		if (baud_sync(3))
+			return(TRUE);
+
+		/* back to the old speed */
+		baud_ipr(old, FALSE);
+		baud_set(old);
+
+		if (!baud_sync(3))
+			return(FALSE);
+	}
+
+	return(FALSE);
+}
+
+/*! Hash of a list of commands.
+ *
+ * \param crc the hash so far.
+ * \param cmds PROGMEM array of PROGMEM commands.
+ * \param n number of commands.
+ * \return the new hash.
+ */
+static uint16_t profile_crc(uint16_t crc, PGM_P const *cmds,
+		const uint8_t n)
+{
+	PGM_P p;
+	uint8_t i;
+	char c;
+
+	for (i = 0; i < n; i++) {
+		p = (PGM_P)pgm_read_word(&cmds[i]);
+
+		while ((c = pgm_read_byte(p++)))
+			crc = _crc16_update(crc, c);
+
+		crc = _crc16_update(crc, ';');
+	}
+
+	return(crc);
+}
+
+/*! Hash of the configuration the modem should have.
+ *
+ * \return crc16 of the commands and the settings.
+ */
+static uint16_t profile_hash(void)
+{
+	uint16_t crc;
+
+	crc = profile_crc(0xffff, cfg_boot,
+			sizeof(cfg_boot) / sizeof(PGM_P));
+	crc = profile_crc(crc, cfg_setup,
+			sizeof(cfg_setup) / sizeof(PGM_P));
+	crc = _crc16_update(crc, sim9->echo_ena);
+	crc = _crc16_update(crc, SIM9_BAUD_ERROR);
+	return(_crc16_update(crc, SIM9_BAUD / 1200));
+}
+
+/*! Is the modem running the profile saved?
+ *
+ * The hash of the configuration must be the one saved and the
+ * modem fixed at the speed saved, which it is only if it has
+ * loaded the profile. A modem in autobauding answers at any speed,
+ * the AT+IPR? tells them apart.
+ *
+ * \return TRUE if the configuration can be skipped.
+ */
+uint8_t sim9_profile_ok(void)
+{
+	struct sim9_profile_t p;
+
+	eeprom_read_block(&p, &sim9_ee_profile,
+			sizeof(struct sim9_profile_t));
+
+	if (p.hash != profile_hash())
+		return(FALSE);
+
+	/* not loaded, the configuration may fail, invalidate it */
+	if ((p.baud != sim9->baud) || (baud_fixed() != sim9->baud)) {
+		eeprom_update_word(&sim9_ee_profile.hash, ~p.hash);
+		return(FALSE);
+	}
 
-	free(buffer);
+	/* ATE is in the profile */
+	sim9->status.echo = sim9->echo_ena;
+	return(TRUE);
 }
 
-/* Check if we are registered on the network
+/*! Save the profile in the modem and its hash in EEPROM.
  *
- * \note 0,1 means registered on the home network.
+ * \return TRUE if saved.
  */
-void network_registered(void)
+uint8_t sim9_profile_save(void)
 {
-	char *buffer;
-	uint8_t retry=5;
+	struct sim9_profile_t p;
 
-	buffer = malloc(20); // String returned by the modem
-	sim9->errors.netreg = TRUE;
+	if (!sim9_send_at_P(PSTR("AT&W"), NULL, 0, SENDAT_TYPE_OK))
+		return(FALSE);
 
-	while (sim9->errors.netreg && retry--) {
-		_delay_ms(2000); // Wait some time to get registered
+	p.hash = profile_hash();
+	p.baud = sim9->baud;
+	eeprom_update_block(&p, &sim9_ee_profile,
+			sizeof(struct sim9_profile_t));
+	return(TRUE);
+}
 
-		if (sim9_send_at_P(PSTR("AT+CGREG?"),
-					buffer, 20, SENDAT_TYPE_MSGOK)) {
-			if (!memcmp_P(buffer, PSTR("+CGREG: 0,1"), 11)) {
-				sim9->status.roaming = FALSE;
-				sim9->errors.netreg = FALSE;
-			} else if (!memcmp_P(buffer, PSTR("+CGREG: 0,5"), 11)) {
-				sim9->status.roaming = TRUE;
-				sim9->errors.netreg = FALSE;
-			}
-		}
+/* sim9_on() script checks */
+uint8_t sim9_boot_cfg(void)
+{
+	return(sim9_send_batch_P(cfg_boot, sizeof(cfg_boot) / sizeof(PGM_P))
+			== sizeof(cfg_boot) / sizeof(PGM_P));
+}
+
+/* the modem was already on at sim9_on() */
+static uint8_t sim9_warm;
+
+/* Wait for the Ready, it may be already received */
+uint8_t sim9_call_ready(void)
+{
+	uint8_t ready;
+
+	/* sent long ago, or not yet if powered just before a reset */
+	if (sim9_warm) {
+		sim9_wait_event(SIM9_URC_CALL_READY, SIM9_WARM_READY);
+		return(TRUE);
 	}
 
-	free(buffer);
+	ready = sim9_wait_event(SIM9_URC_CALL_READY, 60000);
+	sim9_clear_rx_buff();
+	return(ready);
 }
 
-void sim9_suspend(void)
+/* every setup command must succeed */
+uint8_t sim9_setup_cfg(void)
 {
-	usart_suspend(SIM9_SERIAL_PORT);
+	return(sim9_send_batch_P(cfg_setup, sizeof(cfg_setup) / sizeof(PGM_P))
+			== sizeof(cfg_setup) / sizeof(PGM_P));
 }
 
-void sim9_resume(void)
+uint8_t sim9_echo_cfg(void)
 {
-	usart_resume(SIM9_SERIAL_PORT);
+	return(sim9_echo(sim9->echo_ena));
 }
 
-/*! \brief Initialize the serial port if requested.
+/*! sim9_on() script, run after the power on.
  *
- * Also allocate the RXTX struct buffer.
+ * cmd, expect, check, timeout, delay, type, expect_type,
+ * retry, skip, error, ok, fail
+ */
+const struct sim9_step_t sim9_on_script[] PROGMEM = {
+	/* 0: find the speed, the uart is up after the STATUS */
+	{NULL, NULL, sim9_baud_probe, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_ERR_INIT, 1, SIM9_STEP_END},
+	/* 1: skip the configuration if already saved */
+	{NULL, NULL, sim9_profile_ok, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 8, 2},
+	/* 2: URC presentation */
+	{NULL, NULL, sim9_boot_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 3, 12},
+	/* 3: Call Ready */
+	{NULL, NULL, sim9_call_ready, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 4, 4},
+	/* 4: factory default and net light behaviour */
+	{NULL, NULL, sim9_setup_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_ERR_INIT, 5, 14},
+	/* 5: the echo */
+	{NULL, NULL, sim9_echo_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 6, 15},
+	/* 6: the fastest speed */
+	{NULL, NULL, sim9_baud_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 7, 9},
+	/* 7: save the profile, all the configuration succeeded */
+	{NULL, NULL, sim9_profile_save, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 9, 9},
+	/* 8: Call Ready, configuration skipped */
+	{NULL, NULL, sim9_call_ready, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 9, 9},
+	/* 9: the SIM pin */
+	{NULL, NULL, pin_check, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_ERR_PIN, 10, SIM9_STEP_END},
+	/* 10: the IMEI and the identity */
+	{NULL, NULL, sim9_ident, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		10, SIM9_STEP_NONE, SIM9_ERR_IMEI, 11, SIM9_STEP_END},
+	/* 11: network registration */
+	{NULL, NULL, network_registered, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_ERR_NETREG,
+		SIM9_STEP_END, SIM9_STEP_END},
+	/* 12-15: the rest of the configuration after a failure, the
+	 * profile is not saved and the next boot tries it again.
+	 */
+	{NULL, NULL, sim9_call_ready, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 13, 13},
+	{NULL, NULL, sim9_setup_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_ERR_INIT, 14, 14},
+	{NULL, NULL, sim9_echo_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 15, 15},
+	{NULL, NULL, sim9_baud_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 9, 9}
+};
+
+/*! Is the modem powered?
  *
- * \note if the IRQ is used, then it must be already enabled.
- * \warning flags will be cleared on every sim9_on()
+ * \return TRUE if the STATUS pin is high.
  */
-struct sim9_t* sim9_init(void)
+uint8_t sim9_powered(void)
 {
-	if (!sim9) {
-		sim9 = malloc(sizeof(struct sim9_t));
-		/* clear flags */
-		sim9->status.all = 0;
-		sim9->errors.all = 0;
-		sim9->flags = 0;
-		/* allocate the IMEI string */
-		sim9->imei = malloc(IMEI_SIZE);
-		*(sim9->imei) = 0;
-		/* allocate the GSP strings */
-		sim9->gps_lat = malloc(GPS_LAT_SIZE);
-		*(sim9->gps_lat) = 0;
-		sim9->gps_lon = malloc(GPS_LON_SIZE);
-		*(sim9->gps_lon) = 0;
-		/* initialize the usart port */
-		sim9->usart = usart_init(SIM9_SERIAL_PORT);
-		/* convenient link to the TX buffer */
-		sim9->tx_buf = sim9->usart->tx;
-	}
-
-	return(sim9);
+	return((PINA & _BV(SIM9_STATUS)) ? TRUE : FALSE);
 }
 
-/*! remove all the allocated struct
+/*! Wait for the STATUS pin.
+ *
+ * \param on TRUE to wait for the power on, FALSE for the off.
+ * \param timeout in ms.
+ * \return TRUE if the STATUS pin has reached the level.
  */
-void sim9_shut(void)
+uint8_t sim9_status_wait(const uint8_t on, const uint32_t timeout)
 {
-	usart_shut(SIM9_SERIAL_PORT);
-	sim9->tx_buf = NULL;
-	sim9->usart = NULL;
-	free(sim9->gps_lon);
-	free(sim9->gps_lat);
-	free(sim9->imei);
-	free(sim9);
+	uint32_t start;
+
+	start = sim9_millis();
+
+	while (sim9_powered() != on)
+		if (sim9_expired(start, timeout))
+			return(FALSE);
+		else
+			sim9_idle();
+
+	return(TRUE);
 }
 
 /*! \brief power up the modem.
  *
- * \note turning on the modem will take from 11sec to 16 seconds
+ * The power key is pulsed only if the STATUS pin is low, a modem
+ * already on would be turned off. The AT sync starts as soon as
+ * the STATUS pin goes high.
+ *
+ * \note turning on the modem will take from 3sec to 16 seconds
  */
 void sim9_on(void)
 {
 	/* clear all flags */
 	sim9->status.all = 0;
 	sim9->errors.all = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sim9->events = 0;
+	}
+
+	/* the registration starts with the power on */
+	memset(&sim9->reg, 0, sizeof(sim9->reg));
+	sim9->reg.start = sim9_millis();
 	/* start the serial port */
 	usart_resume(SIM9_SERIAL_PORT);
 	/* setup input signal pin */
-	DDRA &= ~(_BV(SIM9_STATUS) | _BV(SIM9_RI) | _BV(SIM9_DTR));
+	DDRA &= ~(_BV(SIM9_STATUS) | _BV(SIM9_RI));
 	DDRD &= ~_BV(SIM9_NET_ST);
+	/* DTR low keeps the modem awake */
+	PORTA &= ~_BV(SIM9_DTR);
+	DDRA |= _BV(SIM9_DTR);
+	sim9_at.waking = FALSE;
+
+#ifdef SIM9_FLOW_CTRL
+	/* ready to receive */
+	DDRA &= ~_BV(SIM9_CTS);
+	PORTA &= ~_BV(SIM9_RTS);
+	DDRA |= _BV(SIM9_RTS);
+#endif
+
+#ifndef SIM9_NO_RI_IRQ
+	/* RI wakes the cpu up */
+	SIM9_RI_PCMSK |= _BV(SIM9_RI);
+	PCICR |= _BV(SIM9_RI_PCIE);
+#endif
 
 	/* Output the power on pin */
-	DDRA |= _BV(SIM9_PIN_ON);
-	/* Start the modem with 1 sec pulse __|--|__ */
 	PORTA &= ~_BV(SIM9_PIN_ON);
-	_delay_ms(1000);
-	PORTA |= _BV(SIM9_PIN_ON);
-	_delay_ms(1000);
-	PORTA &= ~_BV(SIM9_PIN_ON);
-	/* The modem may require 3 sec to start */
-	_delay_ms(4000);
-	/* clear the RX buffer from garbage */
-	usart_clear_rx_buffer(SIM9_SERIAL_PORT);
-
-	/* NOTE: all AT must be uppercase. */
-	sim9_send_at_P(PSTR("AT"), NULL, 0, SENDAT_TYPE_OK);
-
-	/* speed 9600 */
-	sim9_send_at_P(PSTR("AT+IPR=9600"), NULL, 0, SENDAT_TYPE_OK);
-	/* Enable URC presentation */
-	sim9_send_at_P(PSTR("AT+CIURC=1"), NULL, 0, SENDAT_TYPE_OK);
-	/* Wait for the Ready */
-	sim9_searchfor_P(PSTR("Call Ready"), 60, NULL, 0, EQUAL);
+	DDRA |= _BV(SIM9_PIN_ON);
 
-	sim9_clear_rx_buff();
+#ifdef SIM9_PIN_CUT
+	/* supply the modem */
+	PORTA &= ~_BV(SIM9_PIN_CUT);
+	DDRA |= _BV(SIM9_PIN_CUT);
+#endif
 
-	/* Factory default */
-	if (!sim9_send_at_P(PSTR("AT&F&C0&D0"), NULL, 0, SENDAT_TYPE_OK))
-		sim9->errors.init = TRUE;
+	sim9_warm = sim9_powered();
 
-	/* set the echo */
+	if (!sim9_warm) {
+		/* Start the modem with 1 sec pulse __|--|__ */
+		PORTA |= _BV(SIM9_PIN_ON);
+		sim9_delay_ms(SIM9_PWRKEY_PULSE);
+		PORTA &= ~_BV(SIM9_PIN_ON);
 
-#ifdef SIM9_ECHO_ENA
-	sim9->status.echo = 1;
-#endif
+		if (!sim9_status_wait(TRUE, SIM9_STATUS_TIMEOUT)) {
+			sim9->errors.init = TRUE;
+			return;
+		}
+	}
 
-	if (sim9->status.echo)
-		sim9_send_at_P(PSTR("ATE1"), NULL, 0, SENDAT_TYPE_OK);
-	else
-		sim9_send_at_P(PSTR("ATE0"), NULL, 0, SENDAT_TYPE_OK);
+	/* clear the RX buffer from garbage */
+	sim9_clear_rx_buff();
+	sim9_script_P(SIM9_ON_SCRIPT, 0);
+}
 
-	/* set net light behaviour */
-	sim9_send_at_P(PSTR("AT+SLEDS=1,53,790"),
-			NULL, 0, SENDAT_TYPE_OK);
-	sim9_send_at_P(PSTR("AT+SLEDS=2,53,2990"),
-			NULL, 0, SENDAT_TYPE_OK);
-	sim9_send_at_P(PSTR("AT+SLEDS=3,53,287"),
-			NULL, 0, SENDAT_TYPE_OK);
-	sim9_send_at_P(PSTR("AT+CNETLIGHT=1"),
-			NULL, 0, SENDAT_TYPE_OK);
+/*! Put the modem in sleep mode.
+ *
+ * The pending commands and the buffered data are sent, then the
+ * DTR pin is raised and the modem sleeps (AT+CSCLK=1) keeping the
+ * network registration and the PDP context. The next command wakes
+ * it up.
+ */
+void sim9_sleep(void)
+{
+	if (sim9_cipsend.len)
+		sim9_cipsend.flush = TRUE;
 
-	/* check for the SIM pin */
-	if (!sim9->errors.all)
-		pin_check();
+	while (sim9_at_busy() || sim9_cipsend.len ||
+			(sim9_cipsend.state != SIM9_CIPSEND_IDLE)) {
+		sim9_poll();
+		sim9_idle();
+	}
 
-	if (!sim9->errors.all)
-		imei();
+	PORTA |= _BV(SIM9_DTR);
+	sim9->status.sleep = TRUE;
+}
 
-	if (!sim9->errors.all) {
-		/* delay sometime to register on the network */
-		_delay_ms(5000);
-		network_registered();
-	}
+/*! Wake the modem up and wait until it accepts commands.
+ */
+void sim9_wake(void)
+{
+	while (!at_awake())
+		sim9_idle();
 }
 
 /*! Power off the modem.
+ *
+ * The power down is confirmed by the STATUS pin going low. If the
+ * modem hangs the power key is pulsed and then, if possible, the
+ * supply is cut. When it returns with errors.off clear the modem
+ * is really off.
  */
 void sim9_off(void)
 {
-	sim9_send_P(PSTR("AT+CPOWD=1\r"));
+	sim9->errors.off = FALSE;
 
-	if (sim9_searchfor_P(PSTR("NORMAL POWER DOWN"),
-				5, NULL, 0, RELAX))
-		sim9->status.ready = FALSE;
-	else
-		sim9->errors.off = TRUE;
-}
+	if (sim9_powered()) {
+		sim9_wake();
+		sim9_send_P(PSTR("AT+CPOWD=1\r"));
 
-void check_cgatt(void)
-{
-#define SIZEOFBUFFER 15
+		if (!sim9_status_wait(FALSE, SIM9_OFF_TIMEOUT)) {
+			/* hardware power down __|--|__ */
+			PORTA |= _BV(SIM9_PIN_ON);
+			sim9_delay_ms(SIM9_PWRKEY_PULSE);
+			PORTA &= ~_BV(SIM9_PIN_ON);
 
-	char *buffer;
+#ifdef SIM9_PIN_CUT
+			if (!sim9_status_wait(FALSE, SIM9_STATUS_TIMEOUT))
+				PORTA |= _BV(SIM9_PIN_CUT);
+#endif
 
-	buffer = malloc(SIZEOFBUFFER);
+			sim9_status_wait(FALSE, SIM9_STATUS_TIMEOUT);
+		}
+	}
 
-	/* Query the status of the connection */
-	if (sim9_send_at_P(PSTR("AT+CGATT?"), buffer, SIZEOFBUFFER,
-				SENDAT_TYPE_MSGOK)) {
-		if (memcmp_P(buffer, PSTR("+CGATT: 1"), 9))
-			sim9->status.gprs = FALSE;
-		else
-			sim9->status.gprs = TRUE;
+	if (sim9_powered()) {
+		sim9->errors.off = TRUE;
 	} else {
-		sim9->errors.gprs = TRUE;
-	}
+#ifndef SIM9_NO_RI_IRQ
+		/* RI floats */
+		SIM9_RI_PCMSK &= ~_BV(SIM9_RI);
+#endif
 
-	free(buffer);
+		sim9->status.ready = FALSE;
+		sim9_clear_rx_buff();
+	}
 }
 
-/*! attach GPRS network
- *
- * AT+CGATT
- */
-void gprs_connect(void)
+void check_cgatt(void)
 {
-	uint8_t retry;
-
-	sim9->errors.gprs = FALSE;
-
-	if (sim9_send_at_P(PSTR("AT+CGATT=1"),
-				NULL, 0, SENDAT_TYPE_OK)) {
-		retry = 5;
+	struct sim9_view_t v;
 
-		do
-			check_cgatt();
-		while (!sim9->status.gprs && retry--);
+	/* Query the status of the connection */
+	if (sim9_send_at_view_P(PSTR("AT+CGATT?"), &v)) {
+		sim9->status.gprs = sim9_view_P(&v, PSTR("+CGATT: 1"));
+		sim9_view_end();
 	} else {
 		sim9->errors.gprs = TRUE;
 	}
@@ -803,64 +3098,437 @@ void gprs_disconnect(void)
 	}
 }
 
-void gprs_wireless_connection(void)
+uint8_t sim9_gprs_attached(void)
+{
+	check_cgatt();
+	return(sim9->status.gprs);
+}
+
+/* set the transparent mode */
+uint8_t sim9_cipmode_cfg(void)
 {
-	if (!sim9_send_at_P(PSTR("AT+CIICR"), NULL, 0,
-			SENDAT_TYPE_OK))
-		sim9->errors.tcpip = TRUE;
+	if (sim9->status.tsmode)
+		return(sim9_send_at_P(PSTR("AT+CIPMODE=1"),
+					NULL, 0, SENDAT_TYPE_OK));
+	else
+		return(sim9_send_at_P(PSTR("AT+CIPMODE=0"),
+					NULL, 0, SENDAT_TYPE_OK));
 }
 
+static const char tcpip_ccfg[] PROGMEM = "AT+CIPCCFG?";
+static const char tcpip_cgatt[] PROGMEM = "AT+CGATT=1";
+static const char tcpip_cops[] PROGMEM = "AT+COPS?";
+/*! APN Setup, built at compile time */
+static const char tcpip_cstt[] PROGMEM = "AT+CSTT=\"" SIM9_APN_OP "\",\""
+	SIM9_APN_USER "\",\"" SIM9_APN_PASSWORD "\"";
+static const char tcpip_ciicr[] PROGMEM = "AT+CIICR";
+static const char tcpip_cifsr[] PROGMEM = "AT+CIFSR";
+
+/*! sim9_tcpip_on() script
+ *
+ * cmd, expect, check, timeout, delay, type, expect_type,
+ * retry, skip, error, ok, fail
+ */
+const struct sim9_step_t sim9_tcpip_script[] PROGMEM = {
+	/* 0: show the TCP config */
+	{tcpip_ccfg, NULL, NULL, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 1, 1},
+	/* 1: the transparent mode */
+	{NULL, NULL, sim9_cipmode_cfg, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 2, 2},
+	/* 2: attach GPRS network, if not already */
+	{tcpip_cgatt, NULL, NULL, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_ST_GPRS, SIM9_ERR_GPRS, 3, SIM9_STEP_END},
+	/* 3: wait for the attach, a poll every second */
+	{NULL, NULL, sim9_gprs_attached, 0, 1000, SENDAT_TYPE_OK, EEQUAL,
+		6, SIM9_ST_GPRS, SIM9_ERR_GPRS, 4, SIM9_STEP_END},
+	/* 4: the operator */
+	{tcpip_cops, NULL, NULL, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 5, 5},
+	/* 5: the APN */
+	{tcpip_cstt, NULL, NULL, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE, 6, 6},
+	/* 6: bring up the wireless connection */
+	{tcpip_ciicr, NULL, NULL, 0, 0, SENDAT_TYPE_OK, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_ERR_TCPIP, 7, SIM9_STEP_END},
+	/* 7: GET the assigned IP address */
+	{tcpip_cifsr, NULL, NULL, 0, 0, SENDAT_TYPE_MSG, EEQUAL,
+		1, SIM9_STEP_NONE, SIM9_STEP_NONE,
+		SIM9_STEP_END, SIM9_STEP_END}
+};
+
 /*! TCPIP activate
  *
  * \param transparent enable/disable transparent mode.
  */
 void sim9_tcpip_on(void)
 {
-	char *s;
-
 	sim9->errors.tcpip = FALSE;
+	sim9->status.provider = 1; // Force this
+	sim9_script_P(SIM9_TCPIP_SCRIPT, 0);
+}
 
-	/* show the TCP config */
-	sim9_send_at_P(PSTR("AT+CIPCCFG?"), NULL, 0,
-			SENDAT_TYPE_OK);
+/*! the CLOSED URC in the data stream */
+static const char urc_closed_eol[] PROGMEM = "\r\nCLOSED\r\n";
 
-	/* set the transparent mode */
-	if (sim9->status.tsmode)
-		sim9_send_at_P(PSTR("AT+CIPMODE=1"),
-				NULL, 0, SENDAT_TYPE_OK);
-	else
-		sim9_send_at_P(PSTR("AT+CIPMODE=0"),
-				NULL, 0, SENDAT_TYPE_OK);
-
-	/* attach GPRS network */
-	gprs_connect();
-
-	if (sim9->status.gprs) {
-		sim9_send_at_P(PSTR("AT+COPS?"), NULL, 0, SENDAT_TYPE_OK);
-		sim9->status.provider = 1; // Force this
-
-		// APN Setup
-		// 16 + sizeof(OP) + sizeof(USER) + sizeof(PASSWORD) + 1
-		s = malloc(30); // FIXME calculate the correct size!
-		strcpy_P(s, PSTR("AT+CSTT=\"")); // 9 chars
-		strcat_P(s, PSTR(SIM9_APN_OP));
-		strcat_P(s, PSTR("\",\"")); // 3 chars
-		strcat_P(s, PSTR(SIM9_APN_USER));
-		strcat_P(s, PSTR("\",\"")); // 3 chars
-		strcat_P(s, PSTR(SIM9_APN_PASSWORD));
-		strcat_P(s, PSTR("\"")); // 1 chars
-		sim9_send_at(s, NULL, 0, SENDAT_TYPE_OK);
-		free(s);
-	}
-
-	if (!sim9->errors.all)
-		gprs_wireless_connection();
-
-	/* GET the assigned IP address */
-	if (!sim9->errors.all) {
-		s = malloc(30);
-		sim9_send_at_P(PSTR("AT+CIFSR"), s, 30,
-				SENDAT_TYPE_MSG);
-		free(s);
+/*! the connection to the server, built at compile time */
+static const char tcpip_cipstart[] PROGMEM = "AT+CIPSTART=\"" SIM9_SERVER_MODE
+	"\",\"" SIM9_SERVER_HOST "\",\"" SIM9_SERVER_PORT "\"";
+
+/*! AT+CIPSTART completion.
+ *
+ * The command answers OK and the connection result follows as an
+ * URC. On ERROR an "ALREADY CONNECT" may follow, it is waited for
+ * a while.
+ */
+static void conn_done(const uint8_t rc, const struct sim9_cmd_t *c)
+{
+	if (sim9_rc_failed(rc) &&
+			(sim9->status.tcpip == SIM9_TCPIP_CONNECTING)) {
+		sim9_conn.start = sim9_millis();
+		sim9_conn.timeout = SIM9_AT_TIMEOUT;
+	}
+}
+
+/*! Start the connection to the server, do not wait.
+ *
+ * The state goes CONNECTING and then, driven by the URCs and by
+ * sim9_poll(), CONNECT_OK or CLOSED after SIM9_CONNECT_TIMEOUT.
+ *
+ * \return TRUE if started or already connected.
+ */
+uint8_t sim9_connect_start(void)
+{
+	struct sim9_cmd_t c;
+
+	if (sim9->status.tcpip == SIM9_TCPIP_CONNECT_OK)
+		return(TRUE);
+
+	c.cmd = tcpip_cipstart;
+	c.expect = NULL;
+	c.msg = NULL;
+	c.done = conn_done;
+	c.timeout = SIM9_AT_TIMEOUT;
+	c.size = 0;
+	c.type = SENDAT_TYPE_OK;
+	c.expect_type = EEQUAL;
+	c.progmem = TRUE;
+
+	if (!sim9_at_submit(&c))
+		return(FALSE);
+
+	sim9->status.tcpip = SIM9_TCPIP_CONNECTING;
+	sim9_conn.start = sim9_millis();
+	sim9_conn.timeout = SIM9_CONNECT_TIMEOUT;
+	return(TRUE);
+}
+
+/*! Connect to the server.
+ *
+ * \return TRUE if connected.
+ */
+uint8_t sim9_connect(void)
+{
+	if (!sim9_connect_start())
+		return(FALSE);
+
+	while (sim9->status.tcpip == SIM9_TCPIP_CONNECTING) {
+		sim9_poll();
+		sim9_idle();
+	}
+
+	if (sim9->status.tcpip != SIM9_TCPIP_CONNECT_OK)
+		return(FALSE);
+
+	if (!sim9->status.tsmode && !sim9_cipsend.max)
+		sim9_send_size();
+
+	return(TRUE);
+}
+
+/*! Close the connection.
+ *
+ * If the close fails the IP stack is shut, if that fails too the
+ * state is read from the modem.
+ */
+void sim9_disconnect(void)
+{
+	sim9->errors.discon = FALSE;
+
+	/* back to command mode */
+	if (sim9->status.connected)
+		sim9_escape();
+
+	if ((sim9->status.tcpip == SIM9_TCPIP_CONNECTING) ||
+			(sim9->status.tcpip == SIM9_TCPIP_CONNECT_OK)) {
+		sim9->status.tcpip = SIM9_TCPIP_CLOSING;
+
+		if (sim9_send_at_P(PSTR("AT+CIPCLOSE"), NULL, 0,
+					SENDAT_TYPE_OK)) {
+			sim9->status.tcpip = SIM9_TCPIP_CLOSED;
+			return;
+		}
+
+		if (sim9_send_at_P(PSTR("AT+CIPSHUT"), NULL, 0,
+					SENDAT_TYPE_OK)) {
+			sim9->status.tcpip = SIM9_TCPIP_INITIAL;
+			return;
+		}
+
+		/* ask the modem, CLOSED if it does not tell */
+		sim9->errors.discon = TRUE;
+		sim9->status.tcpip = SIM9_TCPIP_CLOSED;
+		sim9_tcpip_status();
+	}
+}
+
+/*! Check the connection, nothing is sent to the modem.
+ *
+ * \param status CONNECTING, CONNECTED, CLOSING or CLOSED.
+ * \return TRUE if the connection is in that status.
+ */
+uint8_t sim9_check_connection(const char status)
+{
+	switch (status) {
+		case CONNECTING:
+			return(sim9->status.tcpip == SIM9_TCPIP_CONNECTING);
+		case CONNECTED:
+			return(sim9->status.tcpip == SIM9_TCPIP_CONNECT_OK);
+		case CLOSING:
+			return(sim9->status.tcpip == SIM9_TCPIP_CLOSING);
+		case CLOSED:
+			return(sim9->status.tcpip != SIM9_TCPIP_CONNECTING &&
+					sim9->status.tcpip != SIM9_TCPIP_CONNECT_OK &&
+					sim9->status.tcpip != SIM9_TCPIP_CLOSING);
+		default:
+			return(FALSE);
+	}
+}
+
+/*! Query the modem for the connection state.
+ *
+ * \return the SIM9_TCPIP_* state.
+ */
+uint8_t sim9_tcpip_status(void)
+{
+	sim9_event(SIM9_URC_STATE);
+
+	/* OK first, then the STATE: URC */
+	if (sim9_send_at_P(PSTR("AT+CIPSTATUS"), NULL, 0, SENDAT_TYPE_OK))
+		sim9_wait_event(SIM9_URC_STATE, SIM9_AT_TIMEOUT);
+
+	return(sim9->status.tcpip);
+}
+
+/*! Write to the connection in transparent data mode.
+ *
+ * Binary data are sent as they are. The modem leaves the data mode
+ * on "+++" between two idle periods, so up to three '+' sent after
+ * an idle line are held and sent with the next data.
+ *
+ * \param buf the data.
+ * \param len the data size.
+ * \return the bytes written, 0 if not in data mode.
+ */
+uint16_t sim9_stream_write(const uint8_t *buf, const uint16_t len)
+{
+	uint16_t i;
+
+	if (!sim9->status.connected)
+		return(0);
+
+	if ((sim9_stream.plus + len) <= 3 && (sim9_stream.plus ||
+				sim9_expired(sim9_stream.last,
+					SIM9_ESC_GUARD))) {
+		for (i = 0; i < len && buf[i] == '+'; i++);
+
+		if (i == len) {
+			sim9_stream.plus += len;
+			return(len);
+		}
 	}
+
+	stream_flush();
+
+	for (i = 0; i < len; i++)
+		sim9_putchar(buf[i]);
+
+	sim9_stream.last = sim9_millis();
+	return(len);
+}
+
+/*! Read from the connection in transparent data mode.
+ *
+ * The bytes are moved from the usart to buf as they are. When the
+ * connection closes the modem leaves the data mode and sends
+ * "\r\nCLOSED\r\n", it is returned as data, dispatched as the CLOSED
+ * URC and ends the data mode, what follows it goes to the line
+ * parser.
+ *
+ * \param buf the destination.
+ * \param size the size of buf.
+ * \return the bytes read.
+ */
+uint16_t sim9_stream_read(uint8_t *buf, const uint16_t size)
+{
+	uint16_t n, i, end;
+	uint8_t got;
+
+	n = 0;
+
+	while (sim9->status.connected && n < size) {
+		got = usart_get(SIM9_SERIAL_PORT, buf + n,
+				(size - n) > 0xff ? 0xff : (size - n));
+
+		if (!got) {
+			sim9_rx_level(0);
+			break;
+		}
+
+		end = n + got;
+
+		for (i = n; i < end; i++) {
+			/* the LF of the CONNECT line */
+			if (sim9_stream.lf) {
+				sim9_stream.lf = FALSE;
+
+				if (buf[i] == '\n')
+					continue;
+			}
+
+			buf[n++] = buf[i];
+
+			if (buf[i] == pgm_read_byte(urc_closed_eol +
+						sim9_stream.closed))
+				sim9_stream.closed++;
+			else
+				sim9_stream.closed = (buf[i] == '\r');
+
+			if (!pgm_read_byte(urc_closed_eol +
+						sim9_stream.closed)) {
+				sim9->status.connected = FALSE;
+				urc_dispatch(SIM9_URC_CLOSED);
+
+				/* command mode lines */
+				for (i++; i < end; i++)
+					sim9_rx_byte(buf[i]);
+			}
+		}
+	}
+
+	return(n);
+}
+
+/*! Back to the data mode after sim9_escape().
+ *
+ * \return TRUE if in data mode.
+ */
+uint8_t sim9_online(void)
+{
+	struct sim9_cmd_t c;
+
+	c.cmd = PSTR("ATO");
+	c.expect = PSTR("CONNECT");
+	c.msg = NULL;
+	c.done = NULL;
+	c.timeout = 0;
+	c.size = 0;
+	c.type = SENDAT_TYPE_OK;
+	c.expect_type = EEQUAL;
+	c.progmem = TRUE;
+
+	sim9_at_run(&c);
+	sim9->errors.connected = !sim9->status.connected;
+	sim9_stream.last = sim9_millis();
+	return(sim9->status.connected);
+}
+
+/*! Ask the modem the max bytes of one AT+CIPSEND.
+ *
+ * Without it the writes are coalesced up to SIM9_SEND_SIZE.
+ *
+ * \return TRUE if known.
+ */
+uint8_t sim9_send_size(void)
+{
+	struct sim9_view_t v;
+	uint16_t max;
+	uint8_t i;
+
+	max = 0;
+
+	if (sim9_send_at_view_P(PSTR("AT+CIPSEND?"), &v)) {
+		if (sim9_view_P(&v, PSTR("+CIPSEND: ")))
+			for (i = 10; i < v.len &&
+					v.s[i] >= '0' && v.s[i] <= '9'; i++)
+				max = max * 10 + v.s[i] - '0';
+
+		sim9_view_end();
+	}
+
+	sim9_cipsend.max = max;
+	return(max != 0);
+}
+
+/*! Write to the connection in non-transparent mode.
+ *
+ * The data are buffered and sent by sim9_poll() with a single
+ * AT+CIPSEND when the buffer is full or SIM9_SEND_DEADLINE after
+ * the first byte, small writes share the command round trip.
+ * It blocks only while the buffer is full.
+ *
+ * \param buf the data.
+ * \param len the data size.
+ * \return the bytes buffered, 0 if not connected.
+ */
+uint16_t sim9_write(const uint8_t *buf, const uint16_t len)
+{
+	uint16_t n, size, room;
+
+	n = 0;
+	size = cipsend_size();
+
+	while (n < len && !sim9->status.tsmode &&
+			(sim9->status.tcpip == SIM9_TCPIP_CONNECT_OK)) {
+		/* full, wait for the send in flight */
+		if (sim9_cipsend.len >= size) {
+			sim9_poll();
+			sim9_idle();
+			continue;
+		}
+
+		if (!sim9_cipsend.len)
+			sim9_cipsend.start = sim9_millis();
+
+		room = size - sim9_cipsend.len;
+
+		if (room > (len - n))
+			room = len - n;
+
+		memcpy(sim9_cipsend.buf + sim9_cipsend.len, buf + n, room);
+		sim9_cipsend.len += room;
+		n += room;
+	}
+
+	return(n);
+}
+
+/*! Send the buffered data now and wait for the SEND OK.
+ *
+ * \return TRUE if everything written since the last flush was sent.
+ */
+uint8_t sim9_flush(void)
+{
+	uint8_t rc;
+
+	sim9_cipsend.flush = TRUE;
+
+	while (sim9_cipsend.len) {
+		sim9_poll();
+		sim9_idle();
+	}
+
+	rc = sim9_cipsend.rc;
+	sim9_cipsend.rc = SIM9_RC_NONE;
+	return(rc == SIM9_RC_NONE);
 }
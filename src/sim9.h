@@ -42,12 +42,127 @@
 #define SIM9_NET_ST PD6 //! Pin NET status
 #define SIM9_DTR PA7 //! Pin DTR
 
+/*! Pin of the modem power supply switch, high cuts the supply.
+ * Define it if the circuit has one, it is the last resort of
+ * sim9_off().
+ * #define SIM9_PIN_CUT PA3
+ */
+
+/*! Hardware flow control (AT+IFC=2,2).
+ * Define it in the Makefile and connect the RTS and CTS pins.
+ * The usart RX ISR must report its buffer fill level with
+ * sim9_rx_level(), the RTS watermarks (bytes) must fit the usart
+ * RX buffer size and leave room for the bytes the modem sends
+ * after the RTS is raised.
+ * #define SIM9_FLOW_CTRL
+ */
+#ifdef SIM9_FLOW_CTRL
+#define SIM9_RTS PA2 //! Pout RTS, high stops the modem TX
+#define SIM9_CTS PA1 //! Pin CTS, high the modem cannot RX
+#define SIM9_RTS_HIGH 48
+#define SIM9_RTS_LOW 16
+#endif
+
+/*! RI pin change interrupt, PA4 is PCINT4 of the group 0.
+ * To keep the pin change interrupt free, define it in the Makefile
+ * and call sim9_ri_irq() from your own ISR.
+ * #define SIM9_NO_RI_IRQ
+ */
+#define SIM9_RI_PCIE PCIE0
+#define SIM9_RI_PCMSK PCMSK0
+#define SIM9_RI_vect PCINT0_vect
+
+/*! power key pulse (ms) and the max time (ms) to wait for the
+ * STATUS pin to follow it.
+ */
+#define SIM9_PWRKEY_PULSE 1000
+#define SIM9_STATUS_TIMEOUT 5000
+
+/*! time (ms) to wait for a late Call Ready from a modem which was
+ * already on, ex. after a reset of the MCU only.
+ */
+#define SIM9_WARM_READY 3000
+
+/*! server of sim9_connect(), "TCP" or "UDP".
+ * Define them in the Makefile, quoted.
+ */
+#ifndef SIM9_SERVER_MODE
+#define SIM9_SERVER_MODE "TCP"
+#endif
+
+#ifndef SIM9_SERVER_HOST
+#define SIM9_SERVER_HOST "localhost"
+#endif
+
+#ifndef SIM9_SERVER_PORT
+#define SIM9_SERVER_PORT "80"
+#endif
+
+/*! idle time (ms) the modem wants around the +++ escape */
+#define SIM9_ESC_GUARD 1000
+
+/*! max time (ms) for the connection to the server */
+#define SIM9_CONNECT_TIMEOUT 75000
+
+/*! non-transparent mode send buffer (bytes) and max time (ms) a
+ * write waits in it. The writes are coalesced into one AT+CIPSEND
+ * up to the buffer, or the modem max if smaller, or the deadline.
+ * Define them in the Makefile.
+ */
+#ifndef SIM9_SEND_SIZE
+#define SIM9_SEND_SIZE 128
+#endif
+
+#ifndef SIM9_SEND_DEADLINE
+#define SIM9_SEND_DEADLINE 100
+#endif
+
+/*! max time (ms) for the SEND OK after the data */
+#define SIM9_SEND_TIMEOUT 20000
+
+/*! max time (ms) to wait for the network registration and the
+ * time (ms) between the registration queries.
+ */
+#define SIM9_REG_TIMEOUT 60000
+#define SIM9_REG_POLL 5000
+
+/*! max time (ms) for the AT+CPOWD=1 power down */
+#define SIM9_OFF_TIMEOUT 5000
+
+/*! time (ms) the modem needs to accept commands after the DTR
+ * wake up from the sleep mode.
+ */
+#define SIM9_WAKE_DELAY 50
+
+/*! Millisecond time base.
+ * By default TIMER2 is used, F_CPU must be <= 16.384 MHz. Every
+ * timeout is a deadline on this time base.
+ *
+ * To keep TIMER2 free, define it in the Makefile and provide an
+ * external time base with sim9_set_clock() before sim9_init().
+ * #define SIM9_NO_TIMER
+ */
+
 /*! USART port where the modem is connected.
  *
  * On the microcontroller which has more than 1 serial port.
  */
 #define SIM9_SERIAL_PORT 0
 
+/*! speed set by usart_init() and the USART registers of
+ * SIM9_SERIAL_PORT, used to change the speed at runtime.
+ */
+#define SIM9_USART_BAUD 9600
+#define SIM9_UBRR UBRR0
+#define SIM9_UCSRA UCSR0A
+#define SIM9_U2X U2X0
+
+/*! fastest speed negotiated with the modem and the max speed
+ * error (per thousand) allowed with F_CPU.
+ */
+#define SIM9_BAUD 115200
+#define SIM9_BAUD_ERROR 20
+
 /*! Debug serial port.
  * The port must be already initialized.
  *
@@ -56,7 +171,52 @@
  */
 #define SIM9_DEBUG_TXBUF usart1->tx
 
-/*! should the modem works with ECHO enabled? */
+/*! Heap free build.
+ * The sim9 struct is statically allocated and the link fails if
+ * malloc() or free() are pulled in by any module (requires
+ * -ffunction-sections and -Wl,--gc-sections).
+ *
+ * Define it in the Makefile if needed.
+ * #define SIM9_NO_MALLOC
+ */
+
+/*! Line parser buffer size, longer lines are truncated.
+ * The AT command path never allocates from the heap.
+ */
+#define SIM9_LINE_SIZE 64
+
+/*! max number of messages (and seconds) to wait for an AT answer */
+#define SIM9_AT_COUNT 3
+
+/*! max length of a batch command line, \see sim9_send_batch_P()
+ * The modem accepts up to 556 chars, the setup batch takes 97,
+ * 106 with SIM9_FLOW_CTRL.
+ */
+#define SIM9_BATCH_LINE 128
+
+/*! bring-up scripts, \see sim9_script_P()
+ * Define them in the Makefile to run your own tables.
+ */
+#ifndef SIM9_ON_SCRIPT
+#define SIM9_ON_SCRIPT sim9_on_script
+#endif
+
+#ifndef SIM9_TCPIP_SCRIPT
+#define SIM9_TCPIP_SCRIPT sim9_tcpip_script
+#endif
+
+/*! AT command engine queue size */
+#define SIM9_QUEUE_SIZE 4
+
+/*! answer timeout (ms) of the commands not in the per command
+ * timeout table.
+ */
+#define SIM9_AT_TIMEOUT 500
+
+/*! should the modem works with ECHO enabled?
+ * This is the default, it can be changed at runtime with
+ * sim9_echo() or by setting sim9->echo_ena before sim9_on().
+ */
 #define SIM9_ECHO_ENA
 
 /*! string search type of */
@@ -67,6 +227,69 @@
 #define ERELAX 4
 #define ESTRICT 5
 
+/*! line classification, final result codes
+ * \see sim9_classify()
+ */
+#define SIM9_RC_NONE 0 //! not a final result code
+#define SIM9_RC_MATCH 1 //! the searched string
+#define SIM9_RC_OK 2
+#define SIM9_RC_ERROR 3
+#define SIM9_RC_CME_ERROR 4 //! +CME ERROR: <err>
+#define SIM9_RC_CMS_ERROR 5 //! +CMS ERROR: <err>
+#define SIM9_RC_NO_CARRIER 6
+#define SIM9_RC_BUSY 7
+#define SIM9_RC_NO_ANSWER 8
+#define SIM9_RC_NO_DIALTONE 9
+#define SIM9_RC_SEND_FAIL 10
+#define SIM9_RC_CLOSED 11
+#define SIM9_RC_CONNECT_FAIL 12
+#define SIM9_RC_TIMEOUT 13 //! no answer from the modem
+
+/*! unsolicited result codes, bit number in sim9->events
+ * \see sim9_event()
+ */
+#define SIM9_URC_RING 0
+#define SIM9_URC_CMTI 1 //! +CMTI: new SMS
+#define SIM9_URC_PDP_DEACT 2 //! +PDP: DEACT
+#define SIM9_URC_CLOSED 3
+#define SIM9_URC_UNDER_VOLTAGE 4 //! warning or power down
+#define SIM9_URC_OVER_VOLTAGE 5 //! warning or power down
+#define SIM9_URC_CALL_READY 6
+#define SIM9_URC_POWER_DOWN 7 //! NORMAL POWER DOWN
+#define SIM9_URC_RDY 8
+#define SIM9_URC_CREG 9 //! +CREG: GSM registration
+#define SIM9_URC_CGREG 10 //! +CGREG: GPRS registration
+#define SIM9_URC_CONNECT_OK 11
+#define SIM9_URC_ALREADY_CONNECT 12
+#define SIM9_URC_CONNECT_FAIL 13
+#define SIM9_URC_STATE 14 //! STATE: answer to AT+CIPSTATUS
+#define SIM9_URC_CONNECT 15 //! transparent mode data mode
+#define SIM9_URC_NONE 0xff
+
+/*! RI pin pulled low by the modem, not an URC.
+ * The URC, if any, follows on the serial line.
+ */
+#define SIM9_EVENT_RI 31
+
+/*! registration <stat> of +CREG and +CGREG */
+#define SIM9_REG_NONE 0
+#define SIM9_REG_HOME 1
+#define SIM9_REG_SEARCHING 2
+#define SIM9_REG_DENIED 3
+#define SIM9_REG_ROAMING 5
+
+/*! AT+CIPSTATUS states, in status.tcpip */
+#define SIM9_TCPIP_INITIAL 0
+#define SIM9_TCPIP_START 1
+#define SIM9_TCPIP_CONFIG 2
+#define SIM9_TCPIP_GPRSACT 3
+#define SIM9_TCPIP_STATUS 4
+#define SIM9_TCPIP_CONNECTING 5
+#define SIM9_TCPIP_CONNECT_OK 6
+#define SIM9_TCPIP_CLOSING 7
+#define SIM9_TCPIP_CLOSED 8
+#define SIM9_TCPIP_PDP_DEACT 9
+
 /*! connection statuses char
  * \note thiese numbers are modem dependant, do not change them.
  */
@@ -92,6 +315,8 @@
 #define ALARM_CHECK 5
 
 #define IMEI_SIZE 18 //! IMEI size
+#define GMR_SIZE 32 //! firmware revision size
+#define MODEL_SIZE 16 //! model size
 
 /*! status flags */
 #define SIM9_ST_RDY 0 //! Ready (pin ok, network registered)
@@ -100,6 +325,24 @@
 #define SIM9_ST_SAPBR 3 //! http stack enabled
 #define SIM9_ST_HTTP 4 //! http stack enabled
 
+/*! error flags */
+#define SIM9_ERR_INIT 0
+#define SIM9_ERR_OFF 1
+#define SIM9_ERR_PIN 2
+#define SIM9_ERR_IMEI 3
+#define SIM9_ERR_APN 4
+#define SIM9_ERR_TCPIP 5
+#define SIM9_ERR_NETREG 6
+#define SIM9_ERR_DISCON 7
+#define SIM9_ERR_GPRS 8
+#define SIM9_ERR_ESC 9
+#define SIM9_ERR_CONNECTED 10
+#define SIM9_ERR_GPS 11
+
+/*! script steps, \see sim9_script_P() */
+#define SIM9_STEP_END 0xff //! stop the script
+#define SIM9_STEP_NONE 0xff //! no status or error flag
+
 #define GPS_LAT_SIZE 12
 #define GPS_LON_SIZE 12
 
@@ -108,6 +351,150 @@
 #define FALSE 0
 #endif
 
+/*! single pass line matcher */
+struct sim9_match_t {
+	const char *s; // caller pattern
+	uint32_t sa; // Shift-And state of the RELAX pattern
+	uint32_t codes; // final result codes still matching
+	uint32_t urcs; // URCs still matching
+	uint8_t pos; // chars consumed
+	uint8_t slen; // caller pattern length
+	uint8_t rc; // final result code found
+	uint8_t urc; // URC found
+	uint8_t progmem:1; // caller pattern in flash
+	uint8_t relax:1; // caller pattern is a substring
+	uint8_t prefix:1; // caller prefix still matching
+	uint8_t found:1; // caller pattern found
+};
+
+/*! line parser fed byte by byte from the usart */
+struct sim9_line_t {
+	struct sim9_match_t match; // running classification
+	const char *expect; // string searched
+	const char *cmd; // command in flight
+	char buf[SIM9_LINE_SIZE];
+	uint8_t len; // chars in buf
+	uint8_t pos; // chars in the line, even if truncated
+	uint8_t rc; // classification of the complete line
+	uint8_t urc; // URC of the complete line
+	uint8_t expect_type;
+	uint8_t expect_progmem:1;
+	uint8_t cmd_progmem:1;
+	uint8_t ready:1; // a complete line is available
+	uint8_t echo:1; // the line is the echo of cmd
+	uint8_t echoed:1; // the echo of cmd has been received
+	uint8_t prompt:1; // '>' data prompt received
+	uint8_t skip:1; // skip the space after the prompt
+	uint8_t held:1; // the line is held for a view
+};
+
+/*! AT command
+ * \see sim9_at_submit()
+ */
+struct sim9_cmd_t {
+	const char *cmd; // the command with AT
+	PGM_P expect; // answer searched, NULL for OK
+	char *msg; // <something> destination, can be NULL
+	/*! completion callback, can be NULL */
+	void (*done)(const uint8_t rc, const struct sim9_cmd_t *c);
+	uint32_t timeout; // ms, 0 from the per command table
+	uint8_t size; // sizeof(msg)
+	uint8_t type; // SENDAT_TYPE_*
+	uint8_t expect_type; // EEQUAL, ERELAX
+	uint8_t progmem; // cmd is a PROGMEM string
+	uint8_t seq; // sequence number, set by the queue
+};
+
+/*! AT command engine */
+struct sim9_at_t {
+	struct sim9_cmd_t queue[SIM9_QUEUE_SIZE];
+	uint32_t start; // command in flight start time
+	uint8_t head;
+	uint8_t count; // queued commands, in flight included
+	uint8_t seq; // last sequence number
+	uint8_t done_seq; // last command completed
+	uint8_t done_rc; // and its result
+	uint32_t wake; // DTR wake up time
+	uint8_t busy:1; // a command is in flight
+	uint8_t captured:1; // the <something> is captured
+	uint8_t waking:1; // waiting for the wake up delay
+};
+
+/*! script step, stored in PROGMEM
+ *
+ * The command, if any, is sent and then the check, if any, is
+ * called. The step succeeds if both succeed, otherwise it is
+ * tried again up to retry times.
+ */
+struct sim9_step_t {
+	PGM_P cmd; // the command with AT, NULL for none
+	PGM_P expect; // answer searched, NULL for OK
+	uint8_t (*check)(void); // TRUE if succeeded, can be NULL
+	uint32_t timeout; // ms, 0 from the per command table
+	uint16_t delay; // ms, before every try
+	uint8_t type; // SENDAT_TYPE_OK, SENDAT_TYPE_MSG
+	uint8_t expect_type; // EEQUAL, ERELAX
+	uint8_t retry; // tries
+	uint8_t skip; // SIM9_ST_* already set skips the step
+	uint8_t error; // SIM9_ERR_* set on failure
+	uint8_t ok; // next step on success
+	uint8_t fail; // next step on failure
+};
+
+/*! modem profile saved with AT&W, stored in EEPROM */
+struct sim9_profile_t {
+	uint16_t hash; // crc16 of the configuration
+	uint32_t baud; // speed of the profile
+};
+
+/*! modem identity, stored in EEPROM */
+struct sim9_ident_t {
+	char imei[IMEI_SIZE];
+	char gmr[GMR_SIZE];
+	char model[MODEL_SIZE];
+	uint16_t crc; // crc16 of the strings, valid cache
+};
+
+/*! client connection */
+struct sim9_conn_t {
+	uint32_t start; // connection start time
+	uint32_t timeout; // ms, to the connection
+};
+
+/*! transparent mode data stream */
+struct sim9_stream_t {
+	uint32_t last; // last byte sent time
+	uint8_t plus; // '+' held after an idle line
+	uint8_t closed; // chars of "\r\nCLOSED\r\n" received
+	uint8_t lf; // skip the LF of the CONNECT line
+};
+
+/*! AT+CIPSEND states */
+#define SIM9_CIPSEND_IDLE 0
+#define SIM9_CIPSEND_CMD 1 //! AT+CIPSEND=<len> queued
+#define SIM9_CIPSEND_PROMPT 2 //! waiting for the '>'
+#define SIM9_CIPSEND_DATA 3 //! data sent, waiting for SEND OK
+
+/*! non-transparent mode send buffer */
+struct sim9_cipsend_t {
+	uint8_t buf[SIM9_SEND_SIZE];
+	char cmd[18]; // AT+CIPSEND=<len>
+	uint32_t start; // first byte buffered time
+	uint32_t sent; // prompt or data sent time
+	uint16_t len; // bytes buffered
+	uint16_t n; // bytes in flight
+	uint16_t max; // modem max, 0 if unknown
+	uint8_t state;
+	uint8_t flush; // do not wait for the deadline
+	uint8_t rc; // failure since sim9_flush(), or NONE
+};
+
+/*! view of a line in the parser, not copied */
+struct sim9_view_t {
+	const char *s;
+	uint8_t len;
+};
+
 struct sim9_t {
 	/*! status flags */
 	union {
@@ -127,10 +514,10 @@ struct sim9_t {
 			uint16_t echo:1; // command echo
 			uint16_t connected:1; // On/Off line
 			uint16_t roaming:1; // Working in roaming
-			uint16_t unused:1;
+			uint16_t sleep:1; // DTR sleep mode
 #else
 			/* msb */
-			uint16_t unused:1;
+			uint16_t sleep:1;
 			uint16_t roaming:1;
 			uint16_t connected:1;
 			uint16_t echo:1;
@@ -197,16 +584,47 @@ struct sim9_t {
 
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 			uint8_t gps_enable:1; // Enable GPS
-			uint8_t unused:7;
+			uint8_t echo_ena:1; // Enable the command echo
+			uint8_t unused:6;
 #else
-			uint8_t unused:7;
+			uint8_t unused:6;
+			uint8_t echo_ena:1;
 			uint8_t gps_ena:1;
 #endif
 
 		};
 	};
 
+	uint32_t baud; // USART speed
+	uint8_t rc; // last final result code received
+	volatile uint32_t events; // URCs received, bit SIM9_URC_*
+
+	/*! URC handler, can be NULL.
+	 * Called on every URC received whatever command is in flight,
+	 * the view is valid only during the call.
+	 */
+	void (*urc_handler)(const uint8_t urc, const struct sim9_view_t *v);
+
+	/*! AT command statistics, clear them to benchmark a sequence */
+	struct {
+		uint32_t total; // ms spent in commands
+		uint16_t last; // ms, round trip of the last command
+		uint16_t count; // commands completed
+	} stats;
+
+	/*! network registration, from the +CREG and +CGREG URCs */
+	struct {
+		uint32_t start; // ms, when the registration started
+		uint32_t latency; // ms, to the last GPRS registration
+		uint16_t lac; // location area code
+		uint16_t ci; // cell id
+		uint8_t creg; // +CREG <stat>
+		uint8_t cgreg; // +CGREG <stat>
+	} reg;
+
 	char *imei;
+	char *gmr; // firmware revision
+	char *model;
 	char *gps_lat;
 	char *gps_lon;
 	char *tx_buf;
@@ -215,16 +633,50 @@ struct sim9_t {
 
 /*! Global */
 struct sim9_t *sim9;
-
+extern const struct sim9_step_t sim9_on_script[];
+extern const struct sim9_step_t sim9_tcpip_script[];
+
+void sim9_timer_init(void);
+void sim9_set_clock(uint32_t (*millis)(void));
+uint32_t sim9_millis(void);
+uint8_t sim9_expired(const uint32_t start, const uint32_t timeout);
+void sim9_idle(void);
+void sim9_delay_ms(const uint32_t ms);
 void sim9_clear_rx_buff(void);
 void sim9_send(const char *s);
 void sim9_send_P(PGM_P s);
+void sim9_rx_level(const uint8_t level);
 void sim9_suspend(void);
 void sim9_resume(void);
 struct sim9_t* sim9_init(void);
+uint8_t sim9_powered(void);
+uint8_t sim9_status_wait(const uint8_t on, const uint32_t timeout);
 void sim9_on(void);
+void sim9_ri_irq(void);
+void sim9_sleep(void);
+void sim9_wake(void);
 void sim9_off(void);
 uint8_t sim9_msg(char *s, const uint8_t size, const uint8_t timeout);
+void sim9_match_init(struct sim9_match_t *m, const char *s,
+		const uint8_t progmem, const uint8_t type);
+void sim9_match_step(struct sim9_match_t *m, const char c);
+uint8_t sim9_match_end(struct sim9_match_t *m);
+uint8_t sim9_classify(const char *line, const char *s,
+		const uint8_t progmem, const uint8_t type);
+uint8_t sim9_rc_failed(const uint8_t rc);
+void sim9_rx_byte(const char c);
+uint8_t sim9_rx_poll(void);
+void sim9_line_next(void);
+uint8_t sim9_line_view(struct sim9_view_t *v, const uint32_t timeout);
+void sim9_line_release(void);
+uint8_t sim9_view_P(const struct sim9_view_t *v, PGM_P s);
+void sim9_line_expect(const char *s, const uint8_t progmem,
+		const uint8_t type);
+void sim9_line_cmd(const char *cmd, const uint8_t progmem);
+void sim9_line_clear(void);
+uint8_t sim9_wait_eol(const uint32_t start, const uint32_t timeout);
+uint8_t sim9_event(const uint8_t urc);
+uint8_t sim9_wait_event(const uint8_t urc, const uint32_t timeout);
 uint8_t sim9_searchfor(const char *s, uint8_t timeout,
 		char *extbuff, const uint8_t size, const uint8_t type);
 uint8_t sim9_searchfor_P(PGM_P s, uint8_t timeout,
@@ -233,9 +685,42 @@ uint8_t sim9_send_at(const char * cmd, char * msg,
 		const uint8_t size, const uint8_t type);
 uint8_t sim9_send_at_P(PGM_P cmd, char* msg,
 		const uint8_t msgsize, const uint8_t type);
+uint8_t sim9_at_submit(const struct sim9_cmd_t *c);
+uint8_t sim9_at_busy(void);
+void sim9_poll(void);
+uint8_t sim9_at_run(const struct sim9_cmd_t *c);
+uint8_t sim9_echo(const uint8_t enable);
+uint8_t sim9_send_batch_P(PGM_P const *cmds, const uint8_t n);
+uint8_t sim9_send_at_view_P(PGM_P cmd, struct sim9_view_t *v);
+uint8_t sim9_script_P(const struct sim9_step_t *script, uint8_t step);
+uint8_t sim9_view_end(void);
+uint8_t sim9_connect_start(void);
 uint8_t sim9_connect(void);
 void sim9_disconnect(void);
 uint8_t sim9_check_connection(const char status);
+uint8_t sim9_tcpip_status(void);
+uint16_t sim9_stream_write(const uint8_t *buf, const uint16_t len);
+uint16_t sim9_stream_read(uint8_t *buf, const uint16_t size);
+uint8_t sim9_online(void);
+uint8_t sim9_send_size(void);
+uint16_t sim9_write(const uint8_t *buf, const uint16_t len);
+uint8_t sim9_flush(void);
+
+/* checks of the bring-up scripts, for your own tables */
+uint8_t sim9_baud_probe(void);
+uint8_t sim9_profile_ok(void);
+uint8_t sim9_boot_cfg(void);
+uint8_t sim9_call_ready(void);
+uint8_t sim9_setup_cfg(void);
+uint8_t sim9_echo_cfg(void);
+uint8_t sim9_baud_cfg(void);
+uint8_t sim9_profile_save(void);
+uint8_t pin_check(void);
+uint8_t sim9_ident(void);
+uint8_t network_registered(void);
+uint8_t sim9_cipmode_cfg(void);
+uint8_t sim9_gprs_attached(void);
+
 void sim9_tcpip_on(void);
 uint8_t sim9_wait4char(const char s, uint8_t timeout);
 void sim9_escape(void);